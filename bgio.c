@@ -25,6 +25,7 @@
 #endif
 
 #include "bgio.h"
+#include "io/io.h"
 #include "log.h"
 #include "cmd.h"
 #include "util.h"
@@ -39,7 +40,7 @@ static struct winsize st_window;			// current winsize of terminal
 
 
 
-static void window_resize(int dummy)
+void bgio_window_resize()
 {
 	ioctl(0, TIOCGWINSZ, (char*)&st_window);
 	ioctl(st_slave_fd, TIOCSWINSZ, (char*)&st_window);
@@ -47,6 +48,14 @@ static void window_resize(int dummy)
 }
 
 
+static void window_resize(int dummy)
+{
+	// if the master uses a signalfd, SIGWINCH is blocked and it
+	// calls bgio_window_resize itself.
+	bgio_window_resize();
+}
+
+
 void bgio_stop()
 {
 	tcsetattr(0, TCSAFLUSH, &st_stdin_ios);
@@ -72,7 +81,7 @@ int bgio_get_window_width()
 }
 
 
-static void do_child()
+static void do_child(io_ctx *io)
 {
 	char *shell;
 	char *name;
@@ -102,6 +111,7 @@ static void do_child()
 	dup2(st_slave_fd, 2);
 	close(st_slave_fd);
 
+	io_exit(io);
 	log_close();
 	fdcheck();
 
@@ -129,7 +139,7 @@ static void do_child()
  * it only exits if it couldn't allocate a pty.  else it exits through bail).
  */
 
-int bgio_start()
+int bgio_start(io_ctx *io)
 {
 	struct termios tt;
 
@@ -157,7 +167,7 @@ int bgio_start()
 	}
 
 	if(st_child_pid == 0) {
-		do_child();
+		do_child(io);
 		perror("executing child");
 		kill(0, SIGTERM);
 		bail(fork_error3);
@@ -6,14 +6,19 @@
  */
 
 
+struct io_ctx;
+
 extern int st_child_pid;	// TODO: get rid of me!
 
 // Opens a pty and forks the child process specified by bgio_subshell_command.
-int bgio_start();
+// The child shuts down io before it execs.
+int bgio_start(struct io_ctx *io);
 // Shuts down everything started by bgio_start, then exits.
 void bgio_stop();
 // closes the fds used by bgio but doesn't deallocate any memory
 void bgio_close();
 
 int bgio_get_window_width();
+// copies our terminal's size to the pty and tells the child
+void bgio_window_resize();
 
@@ -5,8 +5,12 @@
  * Automatically installs the echo task as its first task.
  *
  * TODO: get rid of st_child_pid
- * TODO: stdio is not reentrant.  Can't call log_XX from a signal
- * handler.
+ *
+ * Where there's a signalfd, the signals we care about are blocked and
+ * arrive through an ordinary atom instead.  That way they can't
+ * interrupt any system calls, and the handlers run from the event loop
+ * where they can do anything they want.  Otherwise the signal handlers
+ * only set flags that the event loop checks.
  */
 
 #include <stdio.h>
@@ -14,10 +18,12 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
-#include <limits.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef IO_HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
 
 #include "log.h"
 #include "bgio.h"
@@ -29,7 +35,116 @@
 #include "consoletask.h"
 
 
-static int sigchild_received;
+static volatile sig_atomic_t sigchild_received;
+static volatile sig_atomic_t dump_requested;
+
+
+#ifdef IO_HAVE_SIGNALFD
+
+static io_atom signal_atom = { NULL, -1 };
+static sigset_t signal_old_mask;	// restored for children we fork
+
+
+static void signal_proc(io_atom *atom, int flags)
+{
+	struct signalfd_siginfo si[8];
+	int i, cnt;
+
+	for(;;) {
+		cnt = read(atom->fd, si, sizeof(si));
+		if(cnt <= 0) {
+			// EAGAIN, we've read them all.
+			break;
+		}
+
+		for(i=0; i < cnt / (int)sizeof(si[0]); i++) {
+			switch(si[i].ssi_signo) {
+				case SIGCHLD:
+					// Don't want to handle the child here.  The
+					// event loop reaps it once everything has
+					// been dispatched.
+					log_dbg("Got a sigchild from pid %d", si[i].ssi_pid);
+					sigchild_received = 1;
+					break;
+
+				case SIGPIPE:
+					log_dbg("Got a sigpipe!");
+					break;
+
+				case SIGUSR1:
+					dump_requested = 1;
+					break;
+
+				case SIGWINCH:
+					bgio_window_resize();
+					break;
+			}
+		}
+	}
+}
+
+
+/** Blocks the signals we're interested in and starts reading them
+ *  from a signalfd.
+ *
+ *  @param winch 1 if we should pass SIGWINCH on to the bgio child.
+ *  @returns 0 on success, -1 if the caller should use signal handlers.
+ */
+
+static int signal_start(io_ctx *io, int winch)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGPIPE);
+	sigaddset(&mask, SIGUSR1);
+	if(winch) {
+		sigaddset(&mask, SIGWINCH);
+	}
+
+	sigprocmask(SIG_BLOCK, &mask, &signal_old_mask);
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(fd < 0) {
+		log_warn("Could not create signalfd: %s", strerror(errno));
+		sigprocmask(SIG_SETMASK, &signal_old_mask, NULL);
+		return -1;
+	}
+
+	io_atom_init(&signal_atom, fd, signal_proc);
+	if(io_add(io, &signal_atom, IO_READ) < 0) {
+		close(fd);
+		sigprocmask(SIG_SETMASK, &signal_old_mask, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** Stops reading signals.  If we're about to exec a child, it
+ *  gets the signal mask we started with.  Otherwise the signals stay
+ *  blocked: a pending SIGUSR1 would kill us on the way out.
+ */
+
+static void signal_stop(io_ctx *io, int forking)
+{
+	if(signal_atom.fd < 0) {
+		return;
+	}
+
+	io_del(io, &signal_atom);
+	close(signal_atom.fd);
+	signal_atom.fd = -1;
+
+	if(forking) {
+		sigprocmask(SIG_SETMASK, &signal_old_mask, NULL);
+	}
+}
+
+#endif
 
 
 static void sigchild(int tt)
@@ -37,42 +152,69 @@ static void sigchild(int tt)
 	// Don't want to handle the child here as it could lead to races.
 	// The signal causes select to return early so we'll handle it
 	// before doing any I/O.
-	log_dbg("Got a sigchild!  sigchild_received=%d->%d", sigchild_received, sigchild_received+1);
-	sigchild_received++;
+	sigchild_received = 1;
 }
 
 
 static void sigpipe(int tt)
 {
-	log_dbg("Got a sigpipe!");
+	// Nothing to do, the write gets EPIPE.  (SIG_IGN would be
+	// inherited by the children we exec)
+}
+
+
+static void sigusr1(int tt)
+{
+	// The pipeline gets printed from the event loop, not from here.
+	dump_requested = 1;
+}
+
+
+/** Prints a snapshot of the pipeline if someone sent us a SIGUSR1. */
+
+void master_check_dump(master_pipe *mp)
+{
+	if(!dump_requested) {
+		return;
+	}
+
+	dump_requested = 0;
+	master_pipe_dump(mp);
 }
 
 
+/** Reaps every child that has exited since the last call.
+ *  Several SIGCHLDs can be merged into one so we can't stop at one.
+ */
+
 void master_check_sigchild(master_pipe *mp)
 {
-    int pid, status;
+	int pid, status;
 
 	if(!sigchild_received) {
 		return;
 	}
 
-    // Wait for the child that caused this signal
-    log_dbg("Got sigchld");
-    pid = waitpid(-1, &status, WNOHANG);
-    log_dbg(" ... pid=%d status=%d", pid, status);
-    if(pid <= 0) {
-        log_wtf("waitpid returned %d?! errno=%d (%s)", pid, errno, strerror(errno));
-        return;
-    }
-
-	// dispatch it through the pipe
-    task_dispatch_sigchild(mp, pid);
+	// Clear the flag first so a child that exits while we're
+	// dispatching this one isn't missed.
 	sigchild_received = 0;
+
+	log_dbg("Got sigchld");
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		log_dbg(" ... pid=%d status=%d", pid, status);
+		// dispatch it through the pipe
+		task_dispatch_sigchild(mp, pid);
+	}
 }
 
 
 static void master_pipe_destructor(master_pipe *mp, int free_mem)
 {
+#ifdef IO_HAVE_SIGNALFD
+	// before the default destructor frees mp
+	signal_stop(mp->io, !free_mem);
+#endif
+
 	master_pipe_default_destructor(mp, free_mem);
 
 	if(free_mem) {
@@ -117,10 +259,11 @@ static void master_pipe_sigchild(master_pipe *mp, int pid)
 }
 
 
-/** Idles the topmost task on the master pipe.
+/** Called once each time through the event loop.  Tears everything
+ *  down if the master has gone away.
  */
 
-int master_idle(master_pipe *mp)
+void master_idle(master_pipe *mp)
 {
 	if(mp->master_atom.atom.fd < 0) {
 		// If we were reading from a socket, the socket has gone away.
@@ -131,24 +274,21 @@ int master_idle(master_pipe *mp)
 			task_remove(mp);
 		}
 	}
-
-	task_spec *spec = mp->task_head->spec;
-	return spec->idle_proc ? (*spec->idle_proc)(spec) : INT_MAX;
 }
 
 
-master_pipe* master_setup(int fd)
+master_pipe* master_setup(io_ctx *io, int fd)
 {
 	master_pipe *mp;
 
 	if(fd < 0) {
 		// no socket, so open a tty
-		fd = bgio_start();
+		fd = bgio_start(io);
 	}
 
 	// TODO log_dbg("FD Master: %d", bgio->master);
 	// TODO log_dbg("FD Slave: %d", bgio->slave);
-	mp = master_pipe_init(fd);
+	mp = master_pipe_init(io, fd);
 
 	if(mp == NULL) {
 		perror("allocating master pipe");
@@ -158,8 +298,16 @@ master_pipe* master_setup(int fd)
 	mp->sigchild_proc = master_pipe_sigchild;
 	mp->terminate_proc = master_terminate;
 
+#ifdef IO_HAVE_SIGNALFD
+	// only pass on SIGWINCH if bgio started a child on a pty
+	if(signal_start(io, st_child_pid > 0) == 0) {
+		return mp;
+	}
+#endif
+
 	signal(SIGCHLD, sigchild);
 	signal(SIGPIPE, sigpipe);
+	signal(SIGUSR1, sigusr1);
 
 	return mp;
 }
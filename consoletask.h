@@ -1,4 +1,5 @@
-int master_idle();
-master_pipe* master_setup(int sockfd);
+void master_idle();
+master_pipe* master_setup(io_ctx *io, int sockfd);
 void master_check_sigchild(master_pipe *mp);
+void master_check_dump(master_pipe *mp);
 
@@ -18,6 +18,7 @@
 #include "pipe.h"
 #include "task.h"
 #include "rztask.h"
+#include "zmark.h"
 #include "zrq.h"
 #include "util.h"
 
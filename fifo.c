@@ -2,8 +2,10 @@
  * Scott Bronson
  * 14 Jan 2004
  *
- * Implements a fixed-size fifo buffer.  This can be used to smooth out
- * a bursty stream.
+ * Implements a fifo buffer.  This can be used to smooth out a bursty
+ * stream.  Most of the time the writer keeps up and the fifo is nearly
+ * empty.  When the writer stalls, the fifo inflates (up to maxsize) so
+ * the reader can keep going.  Once it drains, it deflates again.
  *
  * This file is released under the MIT license.  This is basically the
  * same as public domain, but absolves the author of liability.
@@ -13,12 +15,24 @@
  * the stupid filter proc.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// for memfd_create
+#endif
+
 #include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#ifdef MFD_CLOEXEC
+#define FIFO_HAVE_MIRROR
+#endif
+#endif
 
 #include "fifo.h"
 #include "log.h"
@@ -27,13 +41,183 @@
 #define LOG_BUFFER_CONTENTS 0
 
 
+#define FIFO_CHUNK 4096				// inflated fifos are a multiple of this
+#define FIFO_POOL_SLOTS 4			// most buffers we'll keep around
+#define FIFO_POOL_BYTES (256*1024)	// most memory we'll keep around
+
+
+int fifo_pow2 = 1;
+int fifo_mirror = 1;
+
+
+#ifdef FIFO_HAVE_MIRROR
+
+/* Maps the same memfd twice, back to back.  Whatever lies past the
+ * end of the buffer is the start of the buffer again, so every run of
+ * data or free space in the fifo is contiguous in memory.  Returns
+ * NULL if the size isn't a whole number of pages or the kernel won't
+ * play along (the caller falls back to the heap). */
+
+static char* fifo_mirror_alloc(int size)
+{
+	char *buf, *a, *b;
+	int fd;
+
+	if(size % sysconf(_SC_PAGESIZE) != 0) {
+		return NULL;
+	}
+
+	fd = memfd_create("rzh-fifo", MFD_CLOEXEC);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	buf = NULL;
+	if(ftruncate(fd, size) == 0) {
+		// reserve the address space, then map the file over both halves
+		buf = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED) {
+			buf = NULL;
+		} else {
+			a = mmap(buf, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+			b = mmap(buf+size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+			if(a != buf || b != buf+size) {
+				munmap(buf, 2*size);
+				buf = NULL;
+			}
+		}
+	}
+
+	close(fd);
+	return buf;
+}
+
+#endif
+
+
+/* allocates a buffer for the fifo, mirrored if we can manage it.
+ * Sets *contig to the number of bytes that can be addressed from buf. */
+static char* fifo_buf_alloc(int size, int *contig)
+{
+#ifdef FIFO_HAVE_MIRROR
+	char *buf;
+
+	if(fifo_mirror) {
+		buf = fifo_mirror_alloc(size);
+		if(buf) {
+			*contig = 2*size;
+			return buf;
+		}
+	}
+#endif
+
+	*contig = size;
+	return malloc(size);
+}
+
+
+static void fifo_buf_free(char *buf, int size, int contig)
+{
+#ifdef FIFO_HAVE_MIRROR
+	if(contig > size) {
+		munmap(buf, contig);
+		return;
+	}
+#endif
+
+	free(buf);
+}
+
+
+/* Buffers freed by deflating fifos are kept here so the next inflate
+ * doesn't have to go back to the heap.  This is kept small: an idle
+ * rzh shouldn't be sitting on megabytes it's not using.  Like the
+ * pools in pool.c, each thread keeps its own. */
+
+static __thread struct {
+	char *buf;
+	int size;
+	int contig;
+} fifo_pool[FIFO_POOL_SLOTS];
+static __thread int fifo_pool_bytes;
+
+
+static char* fifo_buf_get(int size, int *contig)
+{
+	char *buf;
+	int i;
+
+	for(i=0; i<FIFO_POOL_SLOTS; i++) {
+		if(fifo_pool[i].buf && fifo_pool[i].size == size) {
+			buf = fifo_pool[i].buf;
+			*contig = fifo_pool[i].contig;
+			fifo_pool[i].buf = NULL;
+			fifo_pool_bytes -= size;
+			return buf;
+		}
+	}
+
+	return fifo_buf_alloc(size, contig);
+}
+
+
+static void fifo_buf_put(char *buf, int size, int contig)
+{
+	int i;
+
+	if(fifo_pool_bytes + size <= FIFO_POOL_BYTES) {
+		for(i=0; i<FIFO_POOL_SLOTS; i++) {
+			if(!fifo_pool[i].buf) {
+				fifo_pool[i].buf = buf;
+				fifo_pool[i].size = size;
+				fifo_pool[i].contig = contig;
+				fifo_pool_bytes += size;
+				return;
+			}
+		}
+	}
+
+	fifo_buf_free(buf, size, contig);
+}
+
+
+static int round_pow2(int n)
+{
+	int i = 1;
+
+	while(i < n) {
+		i <<= 1;
+	}
+
+	return i;
+}
+
+
+static void fifo_set_size(struct fifo *f, int size)
+{
+	f->size = size;
+	f->mask = (size & (size - 1)) ? 0 : size - 1;
+}
+
+
 /* name is an arbitrary name for the fifo */
-struct fifo *fifo_init(struct fifo *f, int initsize)
+struct fifo *fifo_init(struct fifo *f, int initsize, int maxsize)
 {
-	f->size = initsize;
+	if(fifo_pow2) {
+		initsize = round_pow2(initsize);
+		maxsize = round_pow2(maxsize);
+	}
+
+	fifo_set_size(f, initsize);
+	f->minsize = initsize;
+	f->maxsize = maxsize > initsize ? maxsize : initsize;
+	f->lowat = initsize / 2;
 	f->beg = f->end = 0;
-	f->buf = (char*)malloc(initsize);
+	f->buf = fifo_buf_alloc(initsize, &f->contig);
 	f->proc = NULL;
+	f->hold = 0;
+	f->mark_proc = NULL;
+	memset(&f->stats, 0, sizeof(f->stats));
 	if(f->buf == NULL) return NULL;
 
 	return f;
@@ -42,30 +226,144 @@ struct fifo *fifo_init(struct fifo *f, int initsize)
 
 void fifo_destroy(struct fifo *f)
 {
-	free(f->buf);
+	fifo_buf_free(f->buf, f->size, f->contig);
+}
+
+
+/* moves the fifo's contents into a new buffer.  The cursors are
+ * left alone so the lifetime counts survive. */
+static void fifo_relocate(struct fifo *f, char *buf, int size, int contig)
+{
+	struct fifo old = *f;
+	int cnt = fifo_count(&old);
+	int pos = fifo_pos(&old, old.beg);
+	int n = old.contig - pos;
+
+	if(n > cnt) {
+		n = cnt;
+	}
+
+	f->buf = buf;
+	fifo_set_size(f, size);
+	f->contig = contig;
+	f->end = f->beg;
+	fifo_unsafe_append(f, old.buf + pos, n);
+	fifo_unsafe_append(f, old.buf, cnt - n);
+
+	fifo_buf_put(old.buf, old.size, old.contig);
+}
+
+
+/** Call this when the fifo is full and its writer has stalled.
+ *  Doubles the size of the fifo (up to maxsize) so we can keep reading.
+ *
+ *  @returns 1 if the fifo grew, 0 if it's as big as it's allowed to get.
+ */
+
+int fifo_inflate(struct fifo *f)
+{
+	int size, contig;
+	char *buf;
+
+	if(f->size >= f->maxsize) {
+		return 0;
+	}
+
+	size = (2*f->size + FIFO_CHUNK - 1) / FIFO_CHUNK * FIFO_CHUNK;
+	if(size > f->maxsize) {
+		size = f->maxsize;
+	}
+
+	buf = fifo_buf_get(size, &contig);
+	if(buf == NULL) {
+		return 0;
+	}
+
+	log_dbg("inflating fifo from %d to %d bytes", f->size, size);
+	fifo_relocate(f, buf, size, contig);
+	return 1;
+}
+
+
+/** Shrinks an inflated fifo back to its original size once it has
+ *  drained below its low water mark.  Cheap to call when there's
+ *  nothing to do.
+ */
+
+void fifo_deflate(struct fifo *f)
+{
+	int contig;
+	char *buf;
+
+	if(f->size == f->minsize || fifo_count(f) > f->lowat) {
+		return;
+	}
+
+	buf = fifo_buf_get(f->minsize, &contig);
+	if(buf == NULL) {
+		return;
+	}
+
+	log_dbg("deflating fifo from %d to %d bytes", f->size, f->minsize);
+	fifo_relocate(f, buf, f->minsize, contig);
+}
+
+
+/** Changes the size that the fifo deflates back to, growing the fifo
+ *  right away if it's currently smaller.  Used to match the fifo to a
+ *  kernel pipe so that each read or write can move a pipe's worth.
+ *
+ *  @returns 1 on success, 0 if the bigger buffer couldn't be allocated.
+ */
+
+int fifo_set_minsize(struct fifo *f, int minsize)
+{
+	int contig;
+	char *buf;
+
+	if(fifo_pow2) {
+		minsize = round_pow2(minsize);
+	}
+	if(minsize > f->maxsize) {
+		minsize = f->maxsize;
+	}
+
+	f->minsize = minsize;
+	f->lowat = minsize / 2;
+
+	if(f->size < minsize) {
+		buf = fifo_buf_get(minsize, &contig);
+		if(buf == NULL) {
+			return 0;
+		}
+		log_dbg("growing fifo from %d to %d bytes", f->size, minsize);
+		fifo_relocate(f, buf, minsize, contig);
+	} else {
+		fifo_deflate(f);
+	}
+
+	return 1;
 }
 
 
 /* erase all data in the fifo */
 void fifo_clear(struct fifo *f)
 {
-	f->beg = f->end = 0;
+	f->beg = f->end;
 }
 
 
 /* returns the number of bytes in the fifo */
-// TODO can get rid of first f->size right?
 int fifo_count(struct fifo *f)
 {
-	return (f->size + f->end - f->beg) % f->size;
+	return (int)(f->end - f->beg);
 }
 
 
 /* returns the amount of free space left in the fifo */
-// TODO can get rid of first f->size right?
 int fifo_avail(struct fifo *f)
 {
-	return (f->size + f->beg - f->end - 1) % f->size;
+	return f->size - (int)(f->end - f->beg);
 }
 
 
@@ -73,8 +371,7 @@ int fifo_avail(struct fifo *f)
 /* make sure there's room before calling! */
 void fifo_unsafe_addchar(struct fifo *f, char c)
 {
-	f->buf[f->end++] = c;
-	if(f->end == f->size) f->end = 0;
+	f->buf[fifo_pos(f, f->end++)] = c;
 }
 
 
@@ -82,25 +379,33 @@ void fifo_unsafe_addchar(struct fifo *f, char c)
 /* make sure there's data in the fifo before calling! */
 int fifo_unsafe_getchar(struct fifo *f)
 {
-	int c = f->buf[f->beg++];
-	if(f->beg == f->size) f->beg = 0;
-	return c;
+	return f->buf[fifo_pos(f, f->beg++)];
 }
 
 
 /* dangerously add a block of data to the fifo */
 /* make sure there's room before calling! */
+/* buf may point into the fifo's own free space (that's how fifo_read
+ * hands data to the filter proc).  If it's already sitting at the end
+ * of the fifo then there's nothing to copy. */
 void fifo_unsafe_append(struct fifo *f, const char *buf, int cnt)
 {
-	if(f->end + cnt > f->size) {
-		int n = f->size - f->end;
-		memcpy(f->buf+f->end, buf, n);
-		memcpy(f->buf, buf+n, cnt - n);
-	} else {
-		memcpy(f->buf+f->end, buf, cnt);
+	int end = fifo_pos(f, f->end);
+
+	if(buf != f->buf + end) {
+		if(end + cnt > f->contig) {
+			int n = f->size - end;
+			memmove(f->buf+end, buf, n);
+			memmove(f->buf, buf+n, cnt - n);
+		} else {
+			memmove(f->buf+end, buf, cnt);
+		}
 	}
 
-	f->end = (f->end + cnt) % f->size;
+	f->end += cnt;
+	if(f->end - f->beg > f->stats.peak) {
+		f->stats.peak = f->end - f->beg;
+	}
 }
 
 
@@ -108,14 +413,25 @@ void fifo_unsafe_append(struct fifo *f, const char *buf, int cnt)
 /* make sure there's room before calling! */
 void fifo_unsafe_prepend(struct fifo *f, const char *buf, int cnt)
 {
-	if(f->beg < cnt) {
-		int n = cnt - f->beg;
-		memcpy(f->buf, buf + n, f->beg);
+	int beg;
+
+	if(!f->mask && f->beg < cnt) {
+		// Can't let the cursors wrap below 0 unless the size
+		// divides 2^64 evenly.  Bump them up by a multiple of size.
+		uint64_t bump = (uint64_t)(cnt / f->size + 1) * f->size;
+		f->beg += bump;
+		f->end += bump;
+	}
+
+	beg = fifo_pos(f, f->beg);
+	f->beg -= cnt;
+
+	if(beg < cnt) {
+		int n = cnt - beg;
+		memcpy(f->buf, buf + n, beg);
 		memcpy(f->buf + f->size - n, buf, n);
-		f->beg = f->size - n;
 	} else {
-		f->beg -= cnt;
-		memcpy(f->buf + f->beg, buf, cnt);
+		memcpy(f->buf + beg - cnt, buf, cnt);
 	}
 }
 
@@ -124,15 +440,17 @@ void fifo_unsafe_prepend(struct fifo *f, const char *buf, int cnt)
 /* make sure there's data in the fifo before calling! */
 void fifo_unsafe_unpend(struct fifo *f, char *buf, int cnt)
 {
-	if(f->beg + cnt > f->size) {
-		int n = f->size - f->beg;
-		memcpy(buf, f->buf+f->beg, n);
+	int beg = fifo_pos(f, f->beg);
+
+	if(beg + cnt > f->contig) {
+		int n = f->size - beg;
+		memcpy(buf, f->buf+beg, n);
 		memcpy(buf+n, f->buf, cnt - n);
 	} else {
-		memcpy(buf, f->buf+f->beg, cnt);
+		memcpy(buf, f->buf+beg, cnt);
 	}
 
-	f->beg = (f->beg + cnt) % f->size;
+	f->beg += cnt;
 }
 
 /*
@@ -140,7 +458,7 @@ static void print_fifo(fifo *f)
 {
 	printf("fifo at %08lX  ", (long)f);
 	printf("%s  ", f->name);
-	printf("beg=%d end=%d size=%d", (int)f->beg, (int)f->end, (int)f->size);
+	printf("beg=%llu end=%llu size=%d", (unsigned long long)f->beg, (unsigned long long)f->end, (int)f->size);
 	printf("  count=%d avail=%d\r\n", (int)fifo_count(f), (int)fifo_avail(f));
 }
 */
@@ -213,40 +531,113 @@ void logio(char *gr1, char* gr2, int fd, const char *buf, int cnt, int act)
 #endif
 
 
-/** Partially fill the fifo by calling read().
+/** Partially fill the fifo by calling readv().
  *
- * @returns the number of bytes read (0 is a valid number; it means
- * that the filter proc ate all the data).
+ * The data is read straight into the fifo's free space (one or two
+ * segments, depending on where the free space wraps).  If there's a
+ * filter proc, it's handed each segment in place and appends whatever
+ * it wants to keep.  Passing the data straight through costs nothing
+ * since it's already where fifo_unsafe_append would put it.
  *
- * TODO:
- *  Only performs a single read call.  We should probably read to exhaustion.
- *  So, the first read must not return EAGAIN.  After the first read, we keep
- *  reading until we get EAGAIN.
+ * A proc that eats bytes now and appends them on a later call (zrq
+ * does this with partial start sequences) must set f->hold to the
+ * number of bytes it's holding.  We leave that much room in front of
+ * the new data so the proc doesn't overwrite data it hasn't seen yet.
+ * If there's not enough room for that, we fall back to reading into
+ * a bounce buffer.
  *
- * TODO: get rid of the copy.
- * TODO: make it resize the fifo if necessary to try to exhaust the read
+ * @returns the number of bytes read (0 is a valid number; it means
+ * that the filter proc ate all the data).
  */
 
 int fifo_read(struct fifo *f, int fd)
 {
-	char buf[BUFSIZ];
-	int cnt, n;
-
-	cnt = fifo_avail(f);
-	if(cnt > sizeof(buf)) {
-		cnt = sizeof(buf);
+	char bounce[BUFSIZ];
+	struct iovec iov[2];
+	int niov, cnt;
+
+	niov = fifo_read_iov(f, iov);
+	if(!niov) {
+		iov[0].iov_base = bounce;
+		iov[0].iov_len = fifo_avail(f);
+		if(iov[0].iov_len > sizeof(bounce)) {
+			iov[0].iov_len = sizeof(bounce);
+		}
+		niov = 1;
 	}
 
-	do {
+	for(;;) {
 		errno = 0;
-		n = read(fd, buf, cnt);
-		if(n == -1) {
-			log_dbg("Error reading %d for fifo: %d (%s)", fd, errno, strerror(errno));
+		cnt = readv(fd, iov, niov);
+		if(cnt != -1 || errno != EINTR) {
+			break;
 		}
-	} while(n == -1 && errno == EINTR);
+		f->stats.reads += 1;
+		f->stats.eintr += 1;
+	}
+
+	return fifo_read_done(f, fd, iov, niov, cnt);
+}
+
+
+/** Fills in where fifo_read reads to: the fifo's free space, minus
+ *  whatever the proc is holding.  Used on its own when the read is
+ *  done by someone else (see pipe.c).  iov must have room for two.
+ *
+ *  @returns the number of iovecs filled in, or 0 if there's no room.
+ */
+
+int fifo_read_iov(struct fifo *f, struct iovec *iov)
+{
+	int room = fifo_avail(f) - f->hold;
+	int pos;
+
+	if(room <= 0) {
+		return 0;
+	}
+
+	pos = fifo_pos(f, f->end + f->hold);
+	iov[0].iov_base = f->buf + pos;
+	iov[0].iov_len = room;
+	if(pos + room > f->contig) {
+		iov[0].iov_len = f->size - pos;
+		iov[1].iov_base = f->buf;
+		iov[1].iov_len = room - iov[0].iov_len;
+		return 2;
+	}
+
+	return 1;
+}
 
-	logio("Read", "from", fd, buf, cnt, n);
-	cnt = n;
+
+/** Does everything fifo_read does after the read itself: counts it,
+ *  then hands the data to the proc.  cnt is what readv returned.
+ *  The iovecs must be the ones fifo_read_iov filled in, or a buffer
+ *  outside the fifo that there's room in the fifo for.
+ *
+ *  The data is usually still in the fifo's buffer while the proc
+ *  looks at it, so the proc must not do anything that moves the fifo
+ *  (inflating it, deflating it, changing its minsize).  Neither the
+ *  proc's buf nor the second iovec would be valid afterward.
+ */
+
+int fifo_read_done(struct fifo *f, int fd, const struct iovec *iov, int niov, int cnt)
+{
+	fifo_proc proc;
+	int old, i, n;
+
+	f->stats.reads += 1;
+	if(cnt == -1) {
+		log_dbg("Error reading %d for fifo: %d (%s)", fd, errno, strerror(errno));
+		if(errno == EAGAIN) {
+			f->stats.eagain += 1;
+		}
+	} else {
+		f->stats.bytes_in += cnt;
+	}
+
+	logio("Read", "from", fd, iov[0].iov_base, iov[0].iov_len,
+			cnt > (int)iov[0].iov_len ? (int)iov[0].iov_len : cnt);
 
 	if(cnt < 0) {
 		// We had better not be told that there's no data to read!
@@ -260,31 +651,45 @@ int fifo_read(struct fifo *f, int fd)
 		cnt = -2;
 	}
 
-
-	if(f->proc) {
-		int old = fifo_avail(f);
-		(*f->proc)(f, buf, cnt, fd);
-		if(cnt > 0) {
-			cnt = old - fifo_avail(f);
-		}
-		if(cnt >= 0) {
-			log_info("RProc copied %d into %d, count is now %d.", cnt, fd,
-					fifo_count(f));
-		} else {
+	if(cnt < 0) {
+		if(f->proc) {
+			(*f->proc)(f, iov[0].iov_base, cnt, fd);
 			log_err("RProc returned %d for %d.", cnt, fd);
 		}
-	} else {
-		// copy the read data into the buffer
-		if(cnt > 0) {
-			fifo_unsafe_append(f, buf, cnt);
+		return cnt;
+	}
+
+	// Hand each segment to the proc in turn.  The proc may be
+	// replaced while handling the first segment (zrq does this
+	// when it starts a new task) so don't cache it.
+	old = fifo_avail(f);
+	proc = f->proc;
+	n = cnt;
+	for(i=0; i<niov && n > 0; i++) {
+		int len = n < (int)iov[i].iov_len ? n : (int)iov[i].iov_len;
+		if(f->proc) {
+			(*f->proc)(f, iov[i].iov_base, len, fd);
+		} else {
+			fifo_unsafe_append(f, iov[i].iov_base, len);
 		}
+		n -= len;
+	}
+
+	if(proc) {
+		cnt = old - fifo_avail(f);
+		log_info("RProc copied %d into %d, count is now %d.", cnt, fd,
+				fifo_count(f));
 	}
 
 	return cnt;
 }
 
 
-/** Attempt to empty the fifo by calling write().
+/** Attempt to empty the fifo by calling writev().
+ *
+ * If the data wraps past the end of the buffer, both segments go
+ * out in a single call so the tail never gets left behind.
+ * Nothing past the fifo's mark is written (see fifo_mark).
  *  
  * @returns the number of bytes written or -1 if there was an error.
  * This routine should never return 0 but I can't guarantee it.
@@ -294,39 +699,95 @@ int fifo_read(struct fifo *f, int fd)
 
 int fifo_write(struct fifo *f, int fd)
 {
-	int cnt = 0;
-	int n;
-
-	if(f->beg < f->end) {
-		do {
-			errno = 0;
-			cnt = write(fd, f->buf+f->beg, f->end-f->beg);
-			logwr(fd, f->buf+f->beg, f->end-f->beg, cnt);
-		} while(cnt == -1 && errno == EINTR);
-		if(cnt > 0) f->beg += cnt;
-	} else if(f->beg > f->end) {
-		do {
-			errno = 0;
-			cnt = write(fd, f->buf+f->beg, f->size-f->beg);
-			logwr(fd, f->buf+f->beg, f->size-f->beg, cnt);
-		} while(cnt == -1 && errno == EINTR);
-		if(cnt > 0) {
-			f->beg = (f->beg + cnt) % f->size;
-			if(f->beg == 0) {
-				do {
-					errno = 0;
-					n = write(fd, f->buf, f->end);
-					logwr(fd, f->buf, f->end, n);
-				} while(n == -1 && errno == EINTR);
-				if(n > 0) { f->beg = n; cnt += n; }
-			}
+	struct iovec iov[2];
+	int niov, cnt;
+
+	niov = fifo_write_iov(f, iov);
+	if(!niov) {
+		return 0;
+	}
+
+	for(;;) {
+		errno = 0;
+		cnt = writev(fd, iov, niov);
+		if(cnt != -1 || errno != EINTR) {
+			break;
 		}
+		f->stats.writes += 1;
+		f->stats.eintr += 1;
 	}
 
+	fifo_write_done(f, fd, iov, cnt);
 	return cnt;
 }
 
 
+/** Fills in what fifo_write writes: everything up to the mark.
+ *  iov must have room for two.
+ *
+ *  @returns the number of iovecs filled in, or 0 if there's nothing
+ *  to write.
+ */
+
+int fifo_write_iov(struct fifo *f, struct iovec *iov)
+{
+	int beg, cnt;
+
+	cnt = fifo_count(f);
+	if(f->mark_proc && cnt > (int)(f->mark - f->beg)) {
+		cnt = (int)(f->mark - f->beg);
+	}
+	if(!cnt) {
+		return 0;
+	}
+
+	beg = fifo_pos(f, f->beg);
+	iov[0].iov_base = f->buf + beg;
+	iov[0].iov_len = cnt;
+	if(beg + cnt > f->contig) {
+		iov[0].iov_len = f->size - beg;
+		iov[1].iov_base = f->buf;
+		iov[1].iov_len = cnt - iov[0].iov_len;
+		return 2;
+	}
+
+	return 1;
+}
+
+
+/** Counts a write of the iovecs from fifo_write_iov and takes what
+ *  was written out of the fifo.  cnt is what writev returned.
+ */
+
+void fifo_write_done(struct fifo *f, int fd, const struct iovec *iov, int cnt)
+{
+	f->stats.writes += 1;
+	logwr(fd, iov[0].iov_base, iov[0].iov_len,
+			cnt > (int)iov[0].iov_len ? (int)iov[0].iov_len : cnt);
+
+	if(cnt > 0) {
+		f->beg += cnt;
+		f->stats.bytes_out += cnt;
+	} else if(cnt == -1 && errno == EAGAIN) {
+		f->stats.eagain += 1;
+	}
+}
+
+
+/** Marks the current end of the fifo.  fifo_write won't write past
+ *  it until the fifo has drained up to the mark and whoever does the
+ *  writing (see pipe.c) has called proc.  Data appended after the
+ *  mark waits in the fifo for whatever the proc sets up.
+ */
+
+void fifo_mark(struct fifo *f, fifo_mark_proc proc, void *refcon)
+{
+	f->mark = f->end;
+	f->mark_proc = proc;
+	f->mark_refcon = refcon;
+}
+
+
 /* copies as much of the contents of one fifo as possible
  * to the other */
 
@@ -334,17 +795,17 @@ int fifo_copy(struct fifo *src, struct fifo *dst)
 {
 	int cnt = fifo_count(src);
 	int ava = fifo_avail(dst);
+	int beg = fifo_pos(src, src->beg);
 	if(ava < cnt) cnt = ava;
 
-	if(src->beg + cnt > src->size) {
-		int n = src->size - src->beg;
-		fifo_unsafe_append(dst, src->buf+src->beg, n);
+	if(beg + cnt > src->contig) {
+		int n = src->size - beg;
+		fifo_unsafe_append(dst, src->buf+beg, n);
 		fifo_unsafe_append(dst, src->buf, cnt - n);
 	} else {
-		fifo_unsafe_append(dst, src->buf+src->beg, cnt);
+		fifo_unsafe_append(dst, src->buf+beg, cnt);
 	}
 
-	src->beg = (src->beg + cnt) % src->size;
+	src->beg += cnt;
 	return cnt;
 }
-
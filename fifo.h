@@ -4,20 +4,43 @@
  *
  * This file is released under the MIT license.  This is basically the
  * same as public domain, but absolves the author of liability.
- *
- * todo: add dynamic resizing.
  */
 
+#include <stdint.h>
+
 struct fifo;
+struct iovec;
 
 typedef void (*fifo_proc)(struct fifo *ff, const char *buf, int size, int fd);
+typedef void (*fifo_mark_proc)(struct fifo *ff, void *refcon);
+
+/* counters kept by fifo_read and fifo_write */
+struct fifo_stats {
+	uint64_t bytes_in;		// bytes read from the fd (before the proc sees them)
+	uint64_t bytes_out;		// bytes written to the fd
+	unsigned long reads;	// reads done (syscalls, or by the io backend)
+	unsigned long writes;	// writes done (syscalls, or by the io backend)
+	unsigned long eagain;	// reads and writes that returned EAGAIN
+	unsigned long eintr;	// syscalls that were interrupted and retried
+	int peak;				// most bytes the fifo has ever held
+};
 
 struct fifo {
 	char *buf;
-	int beg, end;
+	uint64_t beg, end;	// free-running: end-beg bytes in the fifo, end bytes ever added
 	int size;
+	unsigned int mask;	// size-1 if size is a power of two, else 0
+	int contig;		// bytes addressable from buf: 2*size if it's mirrored (see fifo.c)
+	int minsize;	// the size we deflate back to
+	int maxsize;	// the biggest we'll inflate to
+	int lowat;		// deflate once the count drops to this
 	fifo_proc proc;
 	void *refcon;
+	int hold;		// bytes the proc has eaten but will append later (see fifo_read)
+	uint64_t mark;	// while mark_proc is set, fifo_write won't go past this (see fifo_mark)
+	fifo_mark_proc mark_proc;
+	void *mark_refcon;
+	struct fifo_stats stats;
 };
 
 
@@ -29,14 +52,28 @@ struct fifo {
 
 #define fifo_empty(f) 		((f)->beg == (f)->end)
 
+/* converts a cursor into an offset into buf.  Only power-of-two fifos
+ * get to skip the division. */
+#define fifo_pos(f,n)		((f)->mask ? (int)((n) & (f)->mask) : (int)((n) % (f)->size))
+
+/* if set (the default), fifo sizes are rounded up to a power of two */
+extern int fifo_pow2;
+/* if set (the default), fifo buffers are mapped twice so nothing wraps */
+extern int fifo_mirror;
+
 
 /* allocates a fifo initialially able to hold initsize chars
  * and will grow to hold maxsize chars if needed.
  * Returns NULL if fifo memory couldn't be allocated.
  */
-struct fifo* fifo_init(struct fifo *f, int initsize);
+struct fifo* fifo_init(struct fifo *f, int initsize, int maxsize);
 void fifo_destroy(struct fifo *f);
 
+/* grow the fifo when its writer stalls, shrink it once it drains */
+int fifo_inflate(struct fifo *f);
+void fifo_deflate(struct fifo *f);
+int fifo_set_minsize(struct fifo *f, int minsize);
+
 void fifo_clear(struct fifo *f);      /* empty the fifo of all data */
 int fifo_count(struct fifo *f);    /* number of bytes of data in the fifo */
 int fifo_avail(struct fifo *f);    /* free bytes left in the fifo */
@@ -58,6 +95,14 @@ void fifo_unsafe_unpend(struct fifo *f, char *buf, int cnt);
 int fifo_read(struct fifo *f, int fd);
 /* empty the fifo by calling write() */
 int fifo_write(struct fifo *f, int fd);
+/* the same two, split around the syscall for when someone else does
+ * the i/o: find the buffers, then account for what happened */
+int fifo_read_iov(struct fifo *f, struct iovec *iov);
+int fifo_read_done(struct fifo *f, int fd, const struct iovec *iov, int niov, int cnt);
+int fifo_write_iov(struct fifo *f, struct iovec *iov);
+void fifo_write_done(struct fifo *f, int fd, const struct iovec *iov, int cnt);
+/* stop writing at the current end of the fifo until proc is called */
+void fifo_mark(struct fifo *f, fifo_mark_proc proc, void *refcon);
 /* copy as much of the data from src as will fit into dst */
 int fifo_copy(struct fifo *src, struct fifo *dst);
 
@@ -16,7 +16,10 @@
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
+#include "pool.h"
 #include "task.h"
+#include "sha256.h"
+#include "zdecode.h"
 #include "idle.h"
 #include "util.h"
 
@@ -29,6 +32,13 @@ typedef struct {
 	char rbps[64];		// receive rate
 	char sbps[64];		// send rate
 	char xfertime[64];	// elapsed time of transfer
+
+	// and for the current file, if the decoders have seen one
+	char foff[64];		// how far into the file we are
+	char fsize[64];		// the file's length
+	char fbps[64];		// the rate for this file
+	char eta[64];		// time left for this file
+	int percent;		// or -1 if the file's length is unknown
 } idle_numbers;
 
 
@@ -125,28 +135,88 @@ static double timespec_diff(struct timespec *end, struct timespec *start)
 }
 
 
-idle_state* idle_create(master_pipe *mp, const char *command)
+static __thread struct pool idle_pool = POOL_INIT("idle_state", idle_state);
+
+static void idle_update(io_timer *timer);
+
+
+/** Starts displaying the progress of the given task.  The first
+ *  update happens as soon as the event loop gets a chance.
+ */
+
+idle_state* idle_create(task_spec *spec, master_pipe *mp, const char *command)
 {
-	idle_state *idle = malloc(sizeof(idle_state));
+	idle_state *idle = pool_alloc(&idle_pool);
 	if(idle == NULL) {
 		fprintf(stderr, "Could not allocate the idle structure.\n");
 		bail(51);
 	}
-	memset(idle, 0, sizeof(idle_state));
 
+	idle->spec = spec;
 	idle->command = command;
 	idle->send_start_count = mp->input_master.bytes_written;
 	idle->recv_start_count = mp->master_output.bytes_written;
 	idle->call_cnt = 0;
 	clock_gettime(CLOCK_MONOTONIC, &idle->start_time);
 
+	memset(&idle->info, 0, sizeof(idle->info));
+	idle->info.size = -1;
+	zdec_init(&idle->from_sender, &idle->info);
+	zdec_init(&idle->from_receiver, &idle->info);
+	idle->file_num = 0;
+
+	io_timer_init(&idle->timer, idle_update);
+	if(!opt_quiet) {
+		io_timer_add(mp->io, &idle->timer, 0);
+	}
+
 	return idle;
 }
 
 
 void idle_destroy(idle_state* idle)
 {
-	free(idle);
+	pool_free(&idle_pool, idle);
+}
+
+
+/** Fills in the numbers for the file currently being transferred.
+ *  The rate is measured from when the display first noticed the file.
+ */
+
+static void idle_get_file_numbers(idle_state *idle, struct timespec *now, idle_numbers *out)
+{
+	zinfo *info = &idle->info;
+	uint64_t done = 0;
+	double elapsed, rate;
+
+	if(info->file_num != idle->file_num) {
+		idle->file_num = info->file_num;
+		idle->file_start_offset = info->offset;
+		idle->file_start_time = *now;
+	}
+
+	elapsed = timespec_diff(now, &idle->file_start_time);
+	if(info->offset > idle->file_start_offset) {
+		done = info->offset - idle->file_start_offset;
+	}
+	rate = elapsed > 0.0 ? done / elapsed : 0.0;
+
+	human_bytes(info->offset, out->foff, sizeof(out->foff));
+	human_bytes((size_t)rate, out->fbps, sizeof(out->fbps));
+
+	out->percent = -1;
+	strcpy(out->eta, "?");
+	if(info->size >= 0) {
+		human_bytes(info->size, out->fsize, sizeof(out->fsize));
+		out->percent = info->size ? (int)(info->offset * 100 / info->size) : 100;
+		if(out->percent > 100) {
+			out->percent = 100;
+		}
+		if(rate > 0.0 && info->size >= info->offset) {
+			human_time((info->size - info->offset) / rate, out->eta, sizeof(out->eta));
+		}
+	}
 }
 
 
@@ -165,15 +235,17 @@ static void idle_get_numbers(task_spec *spec, idle_numbers *out)
 		xfertime = 0.000000001;
 	}
 
-	int sendcnt = spec->master->input_master.bytes_written - idle->send_start_count;
+	uint64_t sendcnt = spec->master->input_master.bytes_written - idle->send_start_count;
 	human_bytes(sendcnt, out->snum, sizeof(out->snum));
 	human_bytes((size_t)((double)sendcnt/xfertime), out->sbps, sizeof(out->sbps));
 
-	int recvcnt = spec->master->master_output.bytes_written - idle->recv_start_count;
+	uint64_t recvcnt = spec->master->master_output.bytes_written - idle->recv_start_count;
 	human_bytes(recvcnt, out->rnum, sizeof(out->rnum));
 	human_bytes((size_t)((double)recvcnt/xfertime), out->rbps, sizeof(out->rbps));
 
 	human_time(xfertime, out->xfertime, sizeof(out->xfertime));
+
+	idle_get_file_numbers(idle, &end_time, out);
 }
 
 
@@ -193,59 +265,42 @@ static void pad_with_blanks(char *buf, int width)
 
 
 /** Prints a continually updated status string during the transfer.
+ *  Runs off the idle state's timer, which it rearms each time.
  */
 
-int idle_proc(task_spec *spec)
+static void idle_update(io_timer *timer)
 {
 	enum {
-		sleeptime = 300,	// time between invocations in ms.
-		fuzztime = 50,		// if there are less than fuzztime ms until
-			// the idle proc comes due, then we just run the idle proc
-			// now.	 It's early, but the user won't know the difference.
-			// More efficient to do it this way rather than requiring our
-			// own timeout at precisely the right time.
-		// In short:
-		// minimum time to next idleproc: sleeptime - fuzztime.
-		// maximum time to next idleproc: sleeptime.
+		sleeptime = 300,	// time between updates in ms.
 	};
 
-	char buf[256];
+	// big enough for the longest line, filename and all.
+	// It's cut down to the width of the window below.
+	char buf[1024];
 	int len;
 	idle_numbers numbers, *n = &numbers;
-	idle_state *idle = (idle_state*)spec->idle_refcon;
-
-	struct timespec now_time;
-	double diff;
-	int bah;
-
-
-	if(opt_quiet) {
-		return sleeptime;
-	}
-
-	// We will get called much more often than our sleeptime when i/o
-	// is heavy.  Ensure that we don't update the display too fast.
-	// The first time we're called, tv_sec will be 0.  After that,
-	// we just need to ensure that we wait for the appropriate amount
-	// of time before updating the display again.
-	if(idle->last_time.tv_sec != 0) {
-		clock_gettime(CLOCK_MONOTONIC, &now_time);
-		diff = timespec_diff(&now_time, &idle->last_time);
-		bah = sleeptime - (int)(diff*1000);
-		if(bah > fuzztime) {
-			return bah;
-		}
-	}
-
+	idle_state *idle = (idle_state*)timer;
+	task_spec *spec = idle->spec;
 
 	log_dbg("updating display");
 
 	idle->call_cnt += 1;
 	idle_get_numbers(spec, &numbers);
 
-	snprintf(buf, sizeof(buf),
-		"%s %s: received %s at %s/s, sent %s at %s/s",
-		n->xfertime, idle->command, n->rnum, n->rbps, n->snum, n->sbps);
+	if(!idle->info.file_num) {
+		snprintf(buf, sizeof(buf),
+			"%s %s: received %s at %s/s, sent %s at %s/s",
+			n->xfertime, idle->command, n->rnum, n->rbps, n->snum, n->sbps);
+	} else if(n->percent < 0) {
+		snprintf(buf, sizeof(buf),
+			"%s %s: %s %s at %s/s",
+			n->xfertime, idle->command, idle->info.filename, n->foff, n->fbps);
+	} else {
+		snprintf(buf, sizeof(buf),
+			"%s %s: %s %s of %s (%d%%) at %s/s, ETA %s",
+			n->xfertime, idle->command, idle->info.filename, n->foff,
+			n->fsize, n->percent, n->fbps, n->eta);
+	}
 
 	len = get_window_width();
 	if(len > sizeof(buf) - 1) {
@@ -258,8 +313,7 @@ int idle_proc(task_spec *spec)
 	// ok, this list of pointers is a little silly.
 	write(spec->master->task_head->next->spec->outfd, buf, len);
 
-	clock_gettime(CLOCK_MONOTONIC, &idle->last_time);
-	return sleeptime;
+	io_timer_add(spec->master->io, &idle->timer, sleeptime);
 }
 
 
@@ -277,6 +331,8 @@ void idle_end(task_spec *spec)
 	idle_numbers numbers, *n = &numbers;
 	idle_state *idle = (idle_state*)spec->idle_refcon;
 
+	io_timer_del(spec->master->io, &idle->timer);
+
 	if(opt_quiet) {
 		return;
 	}
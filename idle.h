@@ -6,15 +6,22 @@
  */
 
 typedef struct {
+	io_timer timer;			///< goes off each time the display needs updating
+	task_spec *spec;		///< the task whose transfer is being displayed
 	const char *command;	///< the task that this idle proc is watching
-	int recv_start_count;	///< number of bytes in the write pipe when the rz started.
-	int send_start_count;	///< number of bytes in the read pipe when the rz started.
-	int call_cnt;			///< number of times idle proc has been called.
+	uint64_t recv_start_count;	///< number of bytes in the write pipe when the rz started.
+	uint64_t send_start_count;	///< number of bytes in the read pipe when the rz started.
+	int call_cnt;			///< number of times the display has been updated.
 	struct timespec start_time;	///< the time that the transfer started
-	struct timespec last_time;	///< the time that the idle proc last updated its display
+
+	zinfo info;					///< what the decoders have learned about the current file
+	zdecoder from_sender;		///< decodes master -> rz
+	zdecoder from_receiver;		///< decodes rz -> master
+	int file_num;				///< the zinfo::file_num that the file times are for
+	uint64_t file_start_offset;	///< where in the file the display first saw it
+	struct timespec file_start_time;	///< when the display first saw the file
 } idle_state;
 
-idle_state* idle_create(master_pipe *mp, const char *command);
-int idle_proc(task_spec *spec);
+idle_state* idle_create(task_spec *spec, master_pipe *mp, const char *command);
 void idle_end(task_spec *spec);
 
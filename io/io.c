@@ -0,0 +1,285 @@
+// io.c
+// Scott Bronson
+//
+// Picks an io backend at runtime and forwards the io.h calls to it.
+// Also keeps the list of atoms that io_pend asked to run again.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "io.h"
+
+
+extern const struct io_ops io_select_ops;
+extern const struct io_ops io_poll_ops;
+#ifdef IO_HAVE_EPOLL
+extern const struct io_ops io_epoll_ops;
+#endif
+#ifdef IO_HAVE_URING
+extern const struct io_ops io_uring_ops;
+#endif
+
+// see io_timer.c
+void io_timer_start(io_ctx *ctx);
+void io_timer_stop(io_ctx *ctx);
+unsigned int io_timer_timeout(io_ctx *ctx, unsigned int timeout);
+void io_timer_dispatch(io_ctx *ctx);
+
+
+// In order of preference.  io_uring does the pipes' reads and writes
+// itself, batched into the same syscall that waits, so it's tried
+// first.  It needs a recent kernel and is often disabled by policy;
+// its init fails if so and the next one is used.
+static const struct io_ops *backends[] = {
+#ifdef IO_HAVE_URING
+	&io_uring_ops,
+#endif
+#ifdef IO_HAVE_EPOLL
+	&io_epoll_ops,
+#endif
+	&io_poll_ops,
+	&io_select_ops,
+	NULL
+};
+
+
+// The defaults for new contexts.  These are only set while the
+// program is starting up so they don't need to be per-context.
+static const struct io_ops *requested;	// the backend io_use chose, or NULL
+static int use_edge = 1;				// 0 if io_use_level was called
+
+
+// the pending list grows by this many entries at a time.
+#define PEND_INCREMENT 16
+
+
+int io_use(const char *name)
+{
+	const struct io_ops **op;
+
+	for(op = backends; *op; op++) {
+		if(strcmp((*op)->name, name) == 0) {
+			requested = *op;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+const char* io_backend_name(io_ctx *ctx)
+{
+	return ctx->ops ? ctx->ops->name : "none";
+}
+
+
+void io_list_backends(char *buf, int size)
+{
+	const struct io_ops **op;
+	int n = 0;
+
+	buf[0] = '\0';
+	for(op = backends; *op && n < size; op++) {
+		n += snprintf(buf + n, size - n, "%s%s", n ? "|" : "", (*op)->name);
+	}
+}
+
+
+void io_use_level()
+{
+	use_edge = 0;
+}
+
+
+int io_edge_triggered(io_ctx *ctx)
+{
+	return ctx->edge_mask != 0;
+}
+
+
+io_ctx* io_init()
+{
+	const struct io_ops **op;
+	io_ctx *ctx;
+	int err;
+
+	ctx = calloc(1, sizeof(io_ctx));
+	if(ctx == NULL) {
+		fprintf(stderr, "Could not allocate the io context!\n");
+		exit(1);
+	}
+
+	if(requested) {
+		ctx->ops = requested;
+		err = (*ctx->ops->init)(ctx);
+		if(err < 0) {
+			fprintf(stderr, "Could not start the %s io backend: %s\n",
+					ctx->ops->name, strerror(-err));
+			exit(1);
+		}
+	} else {
+		// use the first backend that works
+		for(op = backends; *op; op++) {
+			if((*(*op)->init)(ctx) == 0) {
+				ctx->ops = *op;
+				break;
+			}
+		}
+		if(!*op) {
+			fprintf(stderr, "No io backend could be started!\n");
+			exit(1);
+		}
+	}
+
+	ctx->edge_mask = use_edge && ctx->ops->edge ? IO_EDGE : 0;
+
+	io_timer_start(ctx);
+	return ctx;
+}
+
+
+void io_exit(io_ctx *ctx)
+{
+	io_timer_stop(ctx);
+	(*ctx->ops->exit)(ctx);
+}
+
+
+int io_exit_check(io_ctx *ctx)
+{
+	return (*ctx->ops->exit_check)(ctx);
+}
+
+
+// IO_EDGE is only passed to the backend if it's honored.
+#define io_flags(ctx,ff) ((ff) & (~IO_EDGE | (ctx)->edge_mask))
+
+
+int io_add(io_ctx *ctx, io_atom *atom, int flags)
+{
+	return (*ctx->ops->add)(ctx, atom, io_flags(ctx, flags));
+}
+
+
+int io_enable(io_ctx *ctx, io_atom *atom, int flags)
+{
+	return (*ctx->ops->enable)(ctx, atom, io_flags(ctx, flags));
+}
+
+
+int io_disable(io_ctx *ctx, io_atom *atom, int flags)
+{
+	return (*ctx->ops->disable)(ctx, atom, flags);
+}
+
+
+int io_set(io_ctx *ctx, io_atom *atom, int flags)
+{
+	return (*ctx->ops->set)(ctx, atom, io_flags(ctx, flags));
+}
+
+
+int io_del(io_ctx *ctx, io_atom *atom)
+{
+	int i;
+
+	// make sure a pending call can't find the atom after it's gone
+	for(i=0; i<ctx->num_pending; i++) {
+		if(ctx->pending[i].atom == atom) {
+			ctx->pending[i] = ctx->pending[--ctx->num_pending];
+			break;
+		}
+	}
+	for(i=0; i<ctx->num_running; i++) {
+		if(ctx->running[i].atom == atom) {
+			ctx->running[i].atom = NULL;
+		}
+	}
+
+	return (*ctx->ops->del)(ctx, atom);
+}
+
+
+int io_can_transfer(io_ctx *ctx)
+{
+	return ctx->ops->transfer != NULL;
+}
+
+
+int io_transfer(io_ctx *ctx, io_atom *atom, io_xfer *xfer, int flags)
+{
+	return (*ctx->ops->transfer)(ctx, atom, xfer, flags & (IO_READ | IO_WRITE));
+}
+
+
+void io_cancel(io_ctx *ctx, io_xfer *xfer)
+{
+	if(xfer->busy) {
+		(*ctx->ops->cancel)(ctx, xfer);
+	}
+}
+
+
+void io_pend(io_ctx *ctx, io_atom *atom, int flags)
+{
+	struct io_pending *np, *nr;
+	int i, max;
+
+	for(i=0; i<ctx->num_pending; i++) {
+		if(ctx->pending[i].atom == atom) {
+			ctx->pending[i].flags |= flags;
+			return;
+		}
+	}
+
+	if(ctx->num_pending >= ctx->max_pending) {
+		max = ctx->max_pending + PEND_INCREMENT;
+		np = realloc(ctx->pending, max * sizeof(struct io_pending));
+		if(np) ctx->pending = np;
+		nr = realloc(ctx->running, max * sizeof(struct io_pending));
+		if(nr) ctx->running = nr;
+		if(!np || !nr) {
+			// The atom will still run the next time the backend
+			// reports it.  We'd be in trouble anyway.
+			return;
+		}
+		ctx->max_pending = max;
+	}
+
+	ctx->pending[ctx->num_pending].atom = atom;
+	ctx->pending[ctx->num_pending].flags = flags;
+	ctx->num_pending += 1;
+}
+
+
+int io_wait(io_ctx *ctx, unsigned int timeout)
+{
+	// pending atoms are ready now, there's no sense waiting
+	return (*ctx->ops->wait)(ctx, ctx->num_pending ? 0 : io_timer_timeout(ctx, timeout));
+}
+
+
+void io_dispatch(io_ctx *ctx)
+{
+	struct io_pending *tmp;
+	int i;
+
+	(*ctx->ops->dispatch)(ctx);
+
+	tmp = ctx->running;
+	ctx->running = ctx->pending;
+	ctx->pending = tmp;
+	ctx->num_running = ctx->num_pending;
+	ctx->num_pending = 0;
+
+	for(i=0; i<ctx->num_running; i++) {
+		if(ctx->running[i].atom) {
+			(*ctx->running[i].atom->proc)(ctx->running[i].atom, ctx->running[i].flags);
+		}
+	}
+
+	ctx->num_running = 0;
+
+	io_timer_dispatch(ctx);
+}
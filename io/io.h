@@ -7,19 +7,30 @@
  * This is the generic Async I/O API.  It can be implemented using
  * select, poll, epoll, kqueue, aio, and /dev/poll (hopefully).
  *
- * TODO: should make it so that we can compile every io method
- * into the code then select the most appropriate one at runtime.
+ * Every backend that the platform supports is compiled in.  io.c
+ * picks the best one when io_init is called, unless io_use was
+ * called first to ask for a particular one.
+ *
+ * Every call takes the io_ctx returned by io_init, so a program can
+ * run several independent event loops.
  */
 
 #ifndef IO_H
 #define IO_H
 
+#include <sys/uio.h>
+
 /// Flag, tells if we're interested in read events.
 #define IO_READ 0x01
 /// Flag, tells if we're interested in write events.
 #define IO_WRITE 0x02
 /// Flag, tells if we're interested in exceptional events.
 #define IO_EXCEPT 0x04
+/// Flag, asks to be told only when the fd becomes ready rather than
+/// for as long as it stays ready.  The proc must then do i/o until
+/// it gets EAGAIN or it won't hear about the fd again.  Backends that
+/// can't do this ignore it (see io_edge_triggered).
+#define IO_EDGE 0x08
 
 // reserved for use by applications
 #define IO_USER1 0x10
@@ -27,6 +38,10 @@
 #define IO_USER3 0x40
 #define IO_USER4 0x80
 
+/// Flag, passed to the proc along with IO_READ or IO_WRITE when a
+/// transfer started by io_transfer has finished (see io_xfer).
+#define IO_DONE 0x100
+
 
 /// Tells how many incoming connections we can handle at once
 /// (this is just the backlog parameter to listen)
@@ -67,9 +82,104 @@ typedef struct io_atom {
 
 #define io_atom_init(io,ff,pp) ((io)->fd=(ff),(io)->proc=(pp))
 
-void io_init();     ///< Call this routine once when your code starts.  It prepares the io library for use.
-void io_exit();     ///< Call this routine once when your program terminates.  It just releases any resources allocated by io_init.
-int io_exit_check();	///< Returns how many fds were leaked.  Also prints them to stderr.
+/**
+ * A timer calls its proc once, when it comes due.  The proc may
+ * arm it again to make it periodic.  Like io_atom, it's meant to be
+ * embedded in a larger structure and must exist until it fires or
+ * io_timer_del is called on it.
+ */
+
+typedef struct io_timer {
+	void (*proc)(struct io_timer *timer);	///< Called when the timer comes due.
+	struct io_timer *next;	///< private
+	long long when;			///< private, the ms on the monotonic clock when it's due, 0 if not armed
+} io_timer;
+
+#define io_timer_init(tt,pp) ((tt)->proc=(pp),(tt)->next=NULL,(tt)->when=0)
+
+
+/**
+ * A read or write that the backend does for the atom (see io_transfer).
+ * Only backends that can do i/o themselves (io_uring) support this.
+ * The buffers belong to the kernel until the atom's proc has been
+ * called with IO_DONE or io_cancel has returned.  Until then they must
+ * not be touched, moved, or freed, and neither may the io_xfer.
+ */
+
+typedef struct io_xfer {
+	struct iovec iov[2];	///< where the data goes to or comes from
+	int iovcnt;
+	int result;		///< bytes moved, 0 for EOF, or -errno.  Valid once the transfer is over.
+	int busy;		///< 1 from io_transfer until the proc is called (or io_cancel returns)
+	int done;		///< private: the kernel is finished with it
+	int flags;		///< private: IO_READ or IO_WRITE
+	io_atom *atom;	///< private
+} io_xfer;
+
+
+typedef struct io_ctx io_ctx;
+
+/** Each backend fills in one of these.  See io.c. */
+
+struct io_ops {
+	const char *name;
+	int edge;			///< 1 if the backend honors IO_EDGE.
+	int (*init)(io_ctx *ctx);	///< sets io_ctx::state.  Returns 0 or a negative errno if the backend can't run here.
+	void (*exit)(io_ctx *ctx);
+	int (*exit_check)(io_ctx *ctx);
+	int (*add)(io_ctx *ctx, io_atom *atom, int flags);
+	int (*enable)(io_ctx *ctx, io_atom *atom, int flags);
+	int (*disable)(io_ctx *ctx, io_atom *atom, int flags);
+	int (*set)(io_ctx *ctx, io_atom *atom, int flags);
+	int (*del)(io_ctx *ctx, io_atom *atom);
+	int (*wait)(io_ctx *ctx, unsigned int timeout);
+	void (*dispatch)(io_ctx *ctx);
+	int (*transfer)(io_ctx *ctx, io_atom *atom, io_xfer *xfer, int flags);	///< NULL if the backend can't do i/o itself.
+	void (*cancel)(io_ctx *ctx, io_xfer *xfer);
+};
+
+
+struct io_pending {
+	io_atom *atom;
+	int flags;
+};
+
+
+/**
+ * An event loop.  Everything the io layer knows is kept in here so
+ * any number of them can be run at once, each on its own thread.
+ * A context and its atoms must only be used by one thread at a time.
+ *
+ * Only the backends should look inside.
+ */
+
+struct io_ctx {
+	const struct io_ops *ops;	///< the backend in use
+	void *state;				///< the backend's state, allocated by its init
+	int edge_mask;				///< IO_EDGE if it's honored, otherwise 0
+
+	// io_dispatch runs the pending atoms from a copy so that their
+	// procs can pend again (or delete atoms) without disturbing it.
+	struct io_pending *pending, *running;
+	int num_pending, num_running, max_pending;
+
+	io_timer *timers;			///< armed timers, soonest first
+	int timer_fd;				///< the timerfd, or -1 if there isn't one
+	io_atom timer_atom;
+};
+
+
+// These set the defaults used by every io_init that follows.
+int io_use(const char *name);	///< Selects the backend io_init will use.  Returns 0 if there's no such backend.
+void io_use_level();	///< Ignores IO_EDGE even if the backend could honor it.
+void io_list_backends(char *buf, int size);	///< Fills buf with the names of the compiled-in backends.
+
+io_ctx* io_init();     ///< Creates a new event loop.  Exits if that's not possible.
+void io_exit(io_ctx *ctx);     ///< Releases the kernel resources held by the event loop.  Its memory is kept so io_exit_check still works.
+int io_exit_check(io_ctx *ctx);	///< Returns how many fds were leaked.  Also prints them to stderr.
+
+const char* io_backend_name(io_ctx *ctx);	///< The name of the backend in use.
+int io_edge_triggered(io_ctx *ctx);	///< Returns 1 if IO_EDGE atoms will really be edge-triggered.
 
 
 /** Adds the given io_atom to the current watch list.
@@ -77,21 +187,64 @@ int io_exit_check();	///< Returns how many fds were leaked.  Also prints them to
  * The io_atom must be pre-allocated and exist until you
  * call io_del() on it.
  *
+ * @param ctx The event loop to watch it.
  * @param atom The io_atom to add.
  * @param flags The events to watch for.  Note that there's no way to retrieve the flags once set.
  * @returns The appropriate error code or 0 if there was no error.
  */
 
-int io_add(io_atom *atom, int flags);		///< Adds the given atom to the list of files being watched.
-int io_enable(io_atom *atom, int flags);	///< Enables the given flag(s) without affecting any others.
-int io_disable(io_atom *atom, int flags);	///< Disables the given flag(s) without affecting any others.
-int io_set(io_atom *atom, int flags);   	///< Sets the io_atom::flags on the given atom to flags.
-int io_del(io_atom *atom);              	///< Removes the atom from the list 
+int io_add(io_ctx *ctx, io_atom *atom, int flags);		///< Adds the given atom to the list of files being watched.
+int io_enable(io_ctx *ctx, io_atom *atom, int flags);	///< Enables the given flag(s) without affecting any others.
+int io_disable(io_ctx *ctx, io_atom *atom, int flags);	///< Disables the given flag(s) without affecting any others.
+int io_set(io_ctx *ctx, io_atom *atom, int flags);   	///< Sets the io_atom::flags on the given atom to flags.
+int io_del(io_ctx *ctx, io_atom *atom);              	///< Removes the atom from the list 
+
+/** Asks for the atom's proc to be called with flags on the next
+ *  io_dispatch without waiting for the backend to report anything.
+ *  An edge-triggered atom that stops before reaching EAGAIN uses
+ *  this to make sure it gets back to the fd.  io_wait won't block
+ *  while anything is pending.
+ */
+
+void io_pend(io_ctx *ctx, io_atom *atom, int flags);
+
+/** Tells if the backend can do reads and writes itself.  If not,
+ *  io_transfer must not be called.
+ */
+
+int io_can_transfer(io_ctx *ctx);
+
+/** Asks the backend to read into (IO_READ) or write from (IO_WRITE)
+ *  xfer's iovecs once the atom's fd is ready.  When it's done, the
+ *  atom's proc is called from io_dispatch with IO_DONE and the
+ *  direction, and xfer->result says what happened.  Many transfers
+ *  can be in flight at once (one read and one write per atom is
+ *  typical) and they're all handed to the kernel together the next
+ *  time io_wait is called.  Cancel an atom's transfers before calling
+ *  io_del on it.
+ *
+ *  @returns 0 or a negative errno.
+ */
+
+int io_transfer(io_ctx *ctx, io_atom *atom, io_xfer *xfer, int flags);
+
+/** Takes back the buffers of a transfer that hasn't been dispatched
+ *  yet.  Returns once the kernel is done with them.  The proc won't
+ *  be called.  xfer->result tells what happened anyway: -ECANCELED if
+ *  nothing was transferred, otherwise the transfer finished before it
+ *  could be stopped.  Does nothing if the transfer isn't busy.
+ */
+
+void io_cancel(io_ctx *ctx, io_xfer *xfer);
+
+int io_timer_add(io_ctx *ctx, io_timer *timer, unsigned int ms);	///< Arms the timer to go off in ms milliseconds, rearming it if it's already armed.
+void io_timer_del(io_ctx *ctx, io_timer *timer);		///< Disarms the timer.  It's OK if it isn't armed.
+
 
 /// Waits for an event, then handles it.  Stops waiting if timeout occurs.
 /// Specify INT_MAX for no timeout.  The timeout is specified in ms.
-int io_wait(unsigned int timeout);
-void io_dispatch();
+int io_wait(io_ctx *ctx, unsigned int timeout);
+void io_dispatch(io_ctx *ctx);
 
 #endif
 
@@ -1,79 +1,412 @@
-// epoll.c
+// io_epoll.c
 // Scott Bronson
 //
 // Uses epoll to satisfy gatekeeper's network I/O
+//
+// Unlike select, there's no limit on the number of fds and
+// dispatching costs O(ready fds) rather than O(highest fd).
+// Atoms that ask for IO_EDGE are registered with EPOLLET.
+//
+// io_enable and friends only note the new flags.  The changes are
+// handed to the kernel in one batch just before the next epoll_wait,
+// so a proc that turns IO_WRITE on and off again several times in a
+// single dispatch doesn't cost a syscall each time.
+
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
 #include <sys/epoll.h>
-#include <sys/time.h>
-#include <sys/resource.h>
+#include <sys/types.h>
 #include <unistd.h>
+#include "io.h"
+
+
+// the maximum number of events that can be handled on each
+// call to io_wait().  Any others are returned by the next call.
+#define MAX_EVENTS 64
+
+// the fd table grows by this many entries at a time.
+#define FD_INCREMENT 64
+
+
+struct epoll_conn {
+	io_atom *atom;		// the atom watching this fd or NULL
+	int flags;			// the IO_ flags the atom is interested in
+	int installed;		// the flags the kernel was last told about
+	int registered;		// 1 if the fd is currently in the epoll set
+	int dirty;			// 1 if the fd is on the dirty list
+};
+
+
+// everything the backend keeps for one io_ctx
+struct epoll_state {
+	int epfd;
+	pid_t epoll_owner;	// the process that created epfd
+
+	struct epoll_conn *connections;	// indexed by fd
+	int max_connections;
+
+	int *dirty;			// fds whose flags changed since the last commit
+	int num_dirty;		// (each fd is on it at most once so it's max_connections long)
+
+	struct epoll_event events[MAX_EVENTS];
+	int num_events;
+};
+
 
+static int epoll_io_init(io_ctx *ctx)
+{
+	struct epoll_state *st;
 
-// This is not an upper-limit.  How can we get more insight into
-// exactly what this does?  Is it better to guess high or guess low?
-#define MAXFDS 10000
+	st = calloc(1, sizeof(struct epoll_state));
+	if(st == NULL) {
+		return -ENOMEM;
+	}
 
+	st->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(st->epfd < 0) {
+		free(st);
+		return -errno;
+	}
 
-int epfd;
+	st->epoll_owner = getpid();
+	ctx->state = st;
+	return 0;
+}
 
 
-void io_init()
+static void epoll_io_exit(io_ctx *ctx)
 {
-	struct rlimit rl;
+	struct epoll_state *st = ctx->state;
 
-	if((epfd = epoll_create(MAXFDS)) < 0) {
-		perror("epoll_create");
-		exit(1);
+	if(st->epfd >= 0) {
+		close(st->epfd);
+		st->epfd = -1;
 	}
+}
+
+
+static int epoll_io_exit_check(io_ctx *ctx)
+{
+	struct epoll_state *st = ctx->state;
+	int cnt = 0;
+	int i;
 
-	if(getrlimit(RLIMIT_NOFILE, &rl) == -1) {
-		perror("getrlimit"); 
-		exit(1);
+	// Check that we haven't leaked any atoms.
+	for(i=0; i<st->max_connections; i++) {
+		if(st->connections[i].atom) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)st->connections[i].atom);
+			cnt += 1;
+		}
 	}
 
-	printf("rlimit maxfds: soft=%ld hard=%ld\n",
-			(long)rl.rlim_cur, (long)rl.rlim_max);
+	return cnt;
+}
+
+
+static int grow_connections(struct epoll_state *st, int fd)
+{
+	int max = (fd + FD_INCREMENT) / FD_INCREMENT * FD_INCREMENT;
+	struct epoll_conn *conn;
+	int *nd;
+
+	nd = realloc(st->dirty, max * sizeof(int));
+	if(nd == NULL) {
+		return -ENOMEM;
+	}
+	st->dirty = nd;
+
+	conn = realloc(st->connections, max * sizeof(struct epoll_conn));
+	if(conn == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(conn + st->max_connections, 0,
+			(max - st->max_connections) * sizeof(struct epoll_conn));
+	st->connections = conn;
+	st->max_connections = max;
+
+	return 0;
+}
+
+
+/** Tells the kernel about the fd's new flags.
+ *
+ *  An fd that isn't interested in anything is removed from the epoll
+ *  set entirely.  Otherwise epoll would keep reporting EPOLLHUP on a
+ *  closed pipe that we've stopped reading and we'd spin.
+ */
+
+static int install(struct epoll_state *st, int fd, int flags)
+{
+	struct epoll_conn *conn = &st->connections[fd];
+	struct epoll_event ev;
+	int op;
+
+	conn->flags = flags;
+	conn->installed = flags;
+
+	if(!(flags & (IO_READ | IO_WRITE | IO_EXCEPT))) {
+		if(!conn->registered) {
+			return 0;
+		}
+		conn->registered = 0;
+		return epoll_ctl(st->epfd, EPOLL_CTL_DEL, fd, &ev) < 0 ? -errno : 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if(flags & IO_READ) ev.events |= EPOLLIN;
+	if(flags & IO_WRITE) ev.events |= EPOLLOUT;
+	if(flags & IO_EXCEPT) ev.events |= EPOLLPRI;
+	if(flags & IO_EDGE) ev.events |= EPOLLET;
+
+	op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if(epoll_ctl(st->epfd, op, fd, &ev) < 0) {
+		return -errno;
+	}
+
+	conn->registered = 1;
+	return 0;
+}
+
+
+/** Records the fd's new flags.  They're installed by commit(). */
+
+static int update(struct epoll_state *st, int fd, int flags)
+{
+	struct epoll_conn *conn = &st->connections[fd];
+
+	conn->flags = flags;
+	if(!conn->dirty && conn->flags != conn->installed) {
+		conn->dirty = 1;
+		st->dirty[st->num_dirty++] = fd;
+	}
+
+	return 0;
+}
+
+
+/** Installs all the flags that have changed since the last call.
+ *  An fd whose flags were changed and then changed back is skipped.
+ */
 
-	rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 50;
-	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
-		perror("setrlimit"); 
-		exit(1);
+static void commit(struct epoll_state *st)
+{
+	struct epoll_conn *conn;
+	int i;
+
+	for(i=0; i<st->num_dirty; i++) {
+		conn = &st->connections[st->dirty[i]];
+		conn->dirty = 0;
+		if(conn->atom && conn->flags != conn->installed) {
+			install(st, st->dirty[i], conn->flags);
+		}
 	}
+
+	st->num_dirty = 0;
 }
 
 
-void io_exit()
+static struct epoll_conn* find(struct epoll_state *st, io_atom *atom)
 {
-	close(epfd);
+	if(atom->fd < 0 || atom->fd >= st->max_connections) {
+		return NULL;
+	}
+
+	return &st->connections[atom->fd];
 }
 
 
-int io_add()
+static int epoll_io_add(io_ctx *ctx, io_atom *atom, int flags)
 {
+	struct epoll_state *st = ctx->state;
+	int fd = atom->fd;
 	int err;
 
-	err = epoll_ctl(epfd, EPOLL_CTL_ADD, fd,
-			EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | EPOLLHUP);
-	if(err < 0) {
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(fd >= st->max_connections) {
+		err = grow_connections(st, fd);
+		if(err) {
+			return err;
+		}
+	}
+	if(st->connections[fd].atom) {
+		return -EALREADY;
+	}
+
+	err = install(st, fd, flags);
+	if(err) {
 		return err;
 	}
+
+	st->connections[fd].atom = atom;
+	return 0;
 }
 
 
-void io_set(int fd, int flags)
+static int epoll_io_set(io_ctx *ctx, io_atom *atom, int flags)
 {
-	EPOLL_CTL_MOD
+	struct epoll_state *st = ctx->state;
+	struct epoll_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	return update(st, atom->fd, flags);
 }
 
 
-int io_del(int fd)
+static int epoll_io_enable(io_ctx *ctx, io_atom *atom, int flags)
 {
-	EPOLL_CTL_DEL
+	struct epoll_state *st = ctx->state;
+	struct epoll_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+	if((conn->flags & flags) == flags) {
+		return 0;
+	}
+
+	return update(st, atom->fd, conn->flags | flags);
 }
 
 
-void io_wait(int timeout)
+static int epoll_io_disable(io_ctx *ctx, io_atom *atom, int flags)
 {
+	struct epoll_state *st = ctx->state;
+	struct epoll_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+	if(!(conn->flags & flags)) {
+		return 0;
+	}
+
+	return update(st, atom->fd, conn->flags & ~flags);
 }
 
+
+static int epoll_io_del(io_ctx *ctx, io_atom *atom)
+{
+	struct epoll_state *st = ctx->state;
+	struct epoll_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	// A forked child shares our epoll set.  If it removed its fds
+	// they'd disappear from the parent's set too.  This can't wait
+	// for commit() because the fd is probably about to be closed.
+	if(getpid() == st->epoll_owner) {
+		install(st, atom->fd, 0);
+	}
+
+	// if it's on the dirty list, commit() will skip it.
+	conn->atom = NULL;
+	conn->flags = 0;
+	conn->installed = 0;
+	conn->registered = 0;
+
+	return 0;
+}
+
+
+/** Waits for events.  See io_dispatch to dispatch the events.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds.  INT_MAX is special-cased to mean forever.
+ *
+ * @returns the number of events to be dispatched or a negative
+ * number if there was an error.
+ */
+
+static int epoll_io_wait(io_ctx *ctx, unsigned int timeout)
+{
+	struct epoll_state *st = ctx->state;
+	int ret;
+
+	commit(st);
+
+	ret = epoll_wait(st->epfd, st->events, MAX_EVENTS,
+			timeout == INT_MAX ? -1 : (int)timeout);
+
+	// If we were interrupted by a signal, return so the caller
+	// can handle it.  There's nothing to dispatch.
+	st->num_events = ret > 0 ? ret : 0;
+
+	return ret;
+}
+
+
+static void epoll_io_dispatch(io_ctx *ctx)
+{
+	struct epoll_state *st = ctx->state;
+	int i, fd, flags;
+	struct epoll_conn *conn;
+
+	for(i=0; i<st->num_events; i++) {
+		fd = st->events[i].data.fd;
+		conn = &st->connections[fd];
+
+		// the atom may have been removed or disabled by a proc
+		// that we dispatched earlier in this loop.
+		if(!conn->atom) {
+			continue;
+		}
+
+		flags = 0;
+		if(st->events[i].events & EPOLLIN) flags |= IO_READ;
+		if(st->events[i].events & EPOLLOUT) flags |= IO_WRITE;
+		if(st->events[i].events & EPOLLPRI) flags |= IO_EXCEPT;
+		if(st->events[i].events & (EPOLLERR | EPOLLHUP)) {
+			// select reports these as readable/writable so the
+			// proc discovers the EOF or error when it does the i/o.
+			flags |= IO_READ | IO_WRITE;
+		}
+
+		flags &= conn->flags;
+		if(flags) {
+			(*conn->atom->proc)(conn->atom, flags);
+		}
+	}
+
+	st->num_events = 0;
+}
+
+
+const struct io_ops io_epoll_ops = {
+	"epoll",
+	1,
+	epoll_io_init,
+	epoll_io_exit,
+	epoll_io_exit_check,
+	epoll_io_add,
+	epoll_io_enable,
+	epoll_io_disable,
+	epoll_io_set,
+	epoll_io_del,
+	epoll_io_wait,
+	epoll_io_dispatch,
+};
@@ -1,31 +1,328 @@
-// poll.c
+// io_poll.c
 // Scott Bronson
 //
 // Uses poll to satisfy gatekeeper's network I/O
+//
+// The pollfd array is kept densely packed so poll only looks at
+// fds that we're actually watching, and there's no FD_SETSIZE limit.
+// A separate table maps each fd to its slot in the array.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include "io.h"
 
-#include <sys/poll.h>
 
+// the tables grow by this many entries at a time.
+#define INCREMENT 64
 
-#define MAXFDS 
 
-struct pollfd ufds[MAXFDS];
+// everything the backend keeps for one io_ctx
+struct poll_state {
+	struct pollfd *ufds;	// the array handed to poll
+	io_atom **atoms;		// atoms[i] is watching ufds[i]
+	int *flags;				// flags[i] are the IO_ flags for atoms[i]
+	int num_fds;			// number of slots in use
+	int max_fds;			// number of slots allocated
 
+	int *slots;				// indexed by fd, gives the slot or -1
+	int max_slots;
 
-void io_init()
+	struct pollfd *ready;	// events found by io_wait for io_dispatch
+	int num_ready;
+};
+
+
+static int poll_io_init(io_ctx *ctx)
 {
+	ctx->state = calloc(1, sizeof(struct poll_state));
+	return ctx->state ? 0 : -ENOMEM;
 }
 
 
-void io_exit()
+static void poll_io_exit(io_ctx *ctx)
 {
-	close(epfd);
+	// nothing to do.  The tables are left alone so that
+	// io_exit_check can still find leaked atoms.
 }
 
 
-void io_wait()
+static int poll_io_exit_check(io_ctx *ctx)
 {
-	int nfds;
+	struct poll_state *st = ctx->state;
+	int cnt = 0;
+	int i;
+
+	// Check that we haven't leaked any atoms.
+	for(i=0; i<st->num_fds; i++) {
+		fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", st->atoms[i]->fd, (long)st->atoms[i]);
+		cnt += 1;
+	}
 
-	nfds = epoll_wait(epfd, events, maxevent
+	return cnt;
 }
 
+
+static int grow_slots(struct poll_state *st, int fd)
+{
+	int max = (fd + INCREMENT) / INCREMENT * INCREMENT;
+	int *ns, i;
+
+	ns = realloc(st->slots, max * sizeof(int));
+	if(ns == NULL) {
+		return -ENOMEM;
+	}
+
+	for(i=st->max_slots; i<max; i++) {
+		ns[i] = -1;
+	}
+	st->slots = ns;
+	st->max_slots = max;
+
+	return 0;
+}
+
+
+static int grow_fds(struct poll_state *st)
+{
+	int max = st->max_fds + INCREMENT;
+	struct pollfd *nu, *nr;
+	io_atom **na;
+	int *nf;
+
+	nu = realloc(st->ufds, max * sizeof(struct pollfd));
+	if(nu) st->ufds = nu;
+	na = realloc(st->atoms, max * sizeof(io_atom*));
+	if(na) st->atoms = na;
+	nf = realloc(st->flags, max * sizeof(int));
+	if(nf) st->flags = nf;
+	nr = realloc(st->ready, max * sizeof(struct pollfd));
+	if(nr) st->ready = nr;
+
+	if(!nu || !na || !nf || !nr) {
+		return -ENOMEM;
+	}
+
+	st->max_fds = max;
+	return 0;
+}
+
+
+static void install(struct poll_state *st, int slot, int ff)
+{
+	st->flags[slot] = ff;
+
+	// poll ignores negative fds.  If we left an fd with no flags in
+	// the array, poll would still report POLLHUP on it and we'd spin.
+	st->ufds[slot].fd = ff ? st->atoms[slot]->fd : -1;
+	st->ufds[slot].events = 0;
+	st->ufds[slot].revents = 0;
+	if(ff & IO_READ) st->ufds[slot].events |= POLLIN;
+	if(ff & IO_WRITE) st->ufds[slot].events |= POLLOUT;
+	if(ff & IO_EXCEPT) st->ufds[slot].events |= POLLPRI;
+}
+
+
+static int find(struct poll_state *st, io_atom *atom)
+{
+	if(atom->fd < 0 || atom->fd >= st->max_slots) {
+		return -ERANGE;
+	}
+	if(st->slots[atom->fd] < 0) {
+		return -EALREADY;
+	}
+
+	return st->slots[atom->fd];
+}
+
+
+static int poll_io_add(io_ctx *ctx, io_atom *atom, int ff)
+{
+	struct poll_state *st = ctx->state;
+	int fd = atom->fd;
+	int err;
+
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(fd >= st->max_slots) {
+		err = grow_slots(st, fd);
+		if(err) {
+			return err;
+		}
+	}
+	if(st->slots[fd] >= 0) {
+		return -EALREADY;
+	}
+	if(st->num_fds >= st->max_fds) {
+		err = grow_fds(st);
+		if(err) {
+			return err;
+		}
+	}
+
+	st->slots[fd] = st->num_fds;
+	st->atoms[st->num_fds] = atom;
+	install(st, st->num_fds, ff);
+	st->num_fds += 1;
+
+	return 0;
+}
+
+
+static int poll_io_set(io_ctx *ctx, io_atom *atom, int ff)
+{
+	struct poll_state *st = ctx->state;
+	int slot = find(st, atom);
+
+	if(slot < 0) {
+		return slot;
+	}
+
+	install(st, slot, ff);
+	return 0;
+}
+
+
+static int poll_io_enable(io_ctx *ctx, io_atom *atom, int ff)
+{
+	struct poll_state *st = ctx->state;
+	int slot = find(st, atom);
+
+	if(slot < 0) {
+		return slot;
+	}
+
+	install(st, slot, st->flags[slot] | ff);
+	return 0;
+}
+
+
+static int poll_io_disable(io_ctx *ctx, io_atom *atom, int ff)
+{
+	struct poll_state *st = ctx->state;
+	int slot = find(st, atom);
+
+	if(slot < 0) {
+		return slot;
+	}
+
+	install(st, slot, st->flags[slot] & ~ff);
+	return 0;
+}
+
+
+static int poll_io_del(io_ctx *ctx, io_atom *atom)
+{
+	struct poll_state *st = ctx->state;
+	int slot = find(st, atom);
+	int last = st->num_fds - 1;
+
+	if(slot < 0) {
+		return slot;
+	}
+
+	// move the last entry into the hole to keep the array dense
+	if(slot != last) {
+		st->ufds[slot] = st->ufds[last];
+		st->atoms[slot] = st->atoms[last];
+		st->flags[slot] = st->flags[last];
+		st->slots[st->atoms[slot]->fd] = slot;
+	}
+
+	st->slots[atom->fd] = -1;
+	st->num_fds -= 1;
+
+	return 0;
+}
+
+
+/** Waits for events.  See io_dispatch to dispatch the events.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds.  INT_MAX is special-cased to mean forever.
+ *
+ * @returns the number of events to be dispatched or a negative
+ * number if there was an error.
+ */
+
+static int poll_io_wait(io_ctx *ctx, unsigned int timeout)
+{
+	struct poll_state *st = ctx->state;
+	int i, ret;
+
+	st->num_ready = 0;
+
+	ret = poll(st->ufds, st->num_fds, timeout == INT_MAX ? -1 : (int)timeout);
+	if(ret <= 0) {
+		// If we were interrupted by a signal, return so the caller
+		// can handle it.  There's nothing to dispatch.
+		return ret;
+	}
+
+	// Procs can add and remove atoms, shuffling the array, so we
+	// copy out the events before dispatching any of them.
+	for(i=0; i<st->num_fds && st->num_ready < ret; i++) {
+		if(st->ufds[i].revents) {
+			st->ready[st->num_ready++] = st->ufds[i];
+		}
+	}
+
+	return ret;
+}
+
+
+static void poll_io_dispatch(io_ctx *ctx)
+{
+	struct poll_state *st = ctx->state;
+	int i, slot, ff;
+	short ev;
+
+	for(i=0; i<st->num_ready; i++) {
+		// the atom may have been removed by a proc that we
+		// dispatched earlier in this loop.
+		if(st->ready[i].fd >= st->max_slots || st->slots[st->ready[i].fd] < 0) {
+			continue;
+		}
+		slot = st->slots[st->ready[i].fd];
+		ev = st->ready[i].revents;
+
+		ff = 0;
+		if(ev & POLLIN) ff |= IO_READ;
+		if(ev & POLLOUT) ff |= IO_WRITE;
+		if(ev & POLLPRI) ff |= IO_EXCEPT;
+		if(ev & (POLLERR | POLLHUP | POLLNVAL)) {
+			// select reports these as readable/writable so the
+			// proc discovers the EOF or error when it does the i/o.
+			ff |= IO_READ | IO_WRITE;
+		}
+
+		ff &= st->flags[slot];
+		if(ff) {
+			(*st->atoms[slot]->proc)(st->atoms[slot], ff);
+		}
+	}
+
+	st->num_ready = 0;
+}
+
+
+const struct io_ops io_poll_ops = {
+	"poll",
+	0,
+	poll_io_init,
+	poll_io_exit,
+	poll_io_exit_check,
+	poll_io_add,
+	poll_io_enable,
+	poll_io_disable,
+	poll_io_set,
+	poll_io_del,
+	poll_io_wait,
+	poll_io_dispatch,
+};
@@ -3,55 +3,71 @@
 // 4 October 2003
 //
 // Uses select to satisfy gatekeeper's network I/O
-// Because of select's internal limitations, MAXFDS is 1024.
+// Because of select's internal limitations, it can only watch fds
+// below FD_SETSIZE (usually 1024).  Use poll or epoll for more.
 //
 // This code is licensed under the same terms as Parrot itself.
 
 
-// TODO: should probably make thread-safe by passing a global
-// context everywhere?  This is pretty far in the future...
-
-
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "io.h"
 
 
-static io_atom* connections[FD_SETSIZE];
-static fd_set fd_read, fd_write, fd_except;
-static fd_set gfd_read, gfd_write, gfd_except;
-static int max_fd;	// the highest-numbered filedescriptor in connections.
+// the atom table grows by this many entries at a time.
+#define FD_INCREMENT 64
 
+// everything the backend keeps for one io_ctx
+struct select_state {
+	io_atom** connections;	// indexed by fd
+	int max_connections;
+	fd_set fd_read, fd_write, fd_except;
+	fd_set gfd_read, gfd_write, gfd_except;
+	int max_fd;	// the highest-numbered filedescriptor in connections.
+};
 
-// Pass the file descriptor that you'll be listening and accepting on.
 
-void io_init()
+static int select_io_init(io_ctx *ctx)
 {
-	FD_ZERO(&fd_read);
-	FD_ZERO(&fd_write);
-	FD_ZERO(&fd_except);
+	struct select_state *st;
+
+	st = calloc(1, sizeof(struct select_state));
+	if(st == NULL) {
+		return -ENOMEM;
+	}
+	ctx->state = st;
+
+	st->max_fd = -1;
+	FD_ZERO(&st->fd_read);
+	FD_ZERO(&st->fd_write);
+	FD_ZERO(&st->fd_except);
+
+	return 0;
 }
 
 
-void io_exit()
+static void select_io_exit(io_ctx *ctx)
 {
 	// nothing to do
 }
 
 
-int io_exit_check()
+static int select_io_exit_check(io_ctx *ctx)
 {
+	struct select_state *st = ctx->state;
 	int cnt = 0;
 	int i;
 
 	// Check that we haven't leaked any atoms.
-	for(i=0; i<FD_SETSIZE; i++) {
-		if(connections[i]) {
-			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)connections[i]);
+	for(i=0; i<st->max_connections; i++) {
+		if(st->connections[i]) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)st->connections[i]);
 			cnt += 1;
 		}
 	}
@@ -60,130 +76,169 @@ int io_exit_check()
 }
 
 
-static void install(int fd, int flags)
+static int grow_connections(struct select_state *st, int fd)
+{
+	int max = (fd + FD_INCREMENT) / FD_INCREMENT * FD_INCREMENT;
+	io_atom **conn;
+
+	conn = realloc(st->connections, max * sizeof(io_atom*));
+	if(conn == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(conn + st->max_connections, 0,
+			(max - st->max_connections) * sizeof(io_atom*));
+	st->connections = conn;
+	st->max_connections = max;
+
+	return 0;
+}
+
+
+/** Returns 0 if the fd has an atom, otherwise an error code. */
+
+static int find(struct select_state *st, int fd)
+{
+	if(fd < 0 || fd >= st->max_connections) {
+		return -ERANGE;
+	}
+	if(!st->connections[fd]) {
+		return -EALREADY;
+	}
+
+	return 0;
+}
+
+
+static void install(struct select_state *st, int fd, int flags)
 {
 	if(flags & IO_READ) {
-		FD_SET(fd, &fd_read);
+		FD_SET(fd, &st->fd_read);
 	} else {
-		FD_CLR(fd, &fd_read);
+		FD_CLR(fd, &st->fd_read);
 	}
 
 	if(flags & IO_WRITE) {
-		FD_SET(fd, &fd_write);
+		FD_SET(fd, &st->fd_write);
 	} else {
-		FD_CLR(fd, &fd_write);
+		FD_CLR(fd, &st->fd_write);
 	}
 
 	if(flags & IO_EXCEPT) {
-		FD_SET(fd, &fd_except);
+		FD_SET(fd, &st->fd_except);
 	} else {
-		FD_CLR(fd, &fd_except);
+		FD_CLR(fd, &st->fd_except);
 	}
 }
 
 
-int io_add(io_atom *atom, int flags)
+static int select_io_add(io_ctx *ctx, io_atom *atom, int flags)
 {
+	struct select_state *st = ctx->state;
 	int fd = atom->fd;
+	int err;
 
-	if(fd < 0 || fd > FD_SETSIZE) {
+	if(fd < 0 || fd >= FD_SETSIZE) {
 		return -ERANGE;
 	}
-	if(connections[fd]) {
+	if(fd >= st->max_connections) {
+		err = grow_connections(st, fd);
+		if(err) {
+			return err;
+		}
+	}
+	if(st->connections[fd]) {
 		return -EALREADY;
 	}
 
-	connections[fd] = atom;
-	install(fd, flags);
-	if(fd > max_fd) max_fd = fd;
+	st->connections[fd] = atom;
+	install(st, fd, flags);
+	if(fd > st->max_fd) st->max_fd = fd;
 
 	return 0;
 }
 
 
-int io_set(io_atom *atom, int flags)
+static int select_io_set(io_ctx *ctx, io_atom *atom, int flags)
 {
-	int fd = atom->fd;
+	struct select_state *st = ctx->state;
+	int err = find(st, atom->fd);
 
-	if(fd < 0 || fd > FD_SETSIZE) {
-		return -ERANGE;
-	}
-	if(!connections[fd]) {
-		return -EALREADY;
+	if(err) {
+		return err;
 	}
 
-	install(fd, flags);
+	install(st, atom->fd, flags);
 
 	return 0;
 }
 
 
-int io_enable(io_atom *atom, int flags)
+static int select_io_enable(io_ctx *ctx, io_atom *atom, int flags)
 {
-	if(atom->fd < 0 || atom->fd > FD_SETSIZE) {
-		return -ERANGE;
-	}
-	if(!connections[atom->fd]) {
-		return -EALREADY;
+	struct select_state *st = ctx->state;
+	int err = find(st, atom->fd);
+
+	if(err) {
+		return err;
 	}
 
 	if(flags & IO_READ) {
-		FD_SET(atom->fd, &fd_read);
+		FD_SET(atom->fd, &st->fd_read);
 	}
 
 	if(flags & IO_WRITE) {
-		FD_SET(atom->fd, &fd_write);
+		FD_SET(atom->fd, &st->fd_write);
 	}
 
 	if(flags & IO_EXCEPT) {
-		FD_SET(atom->fd, &fd_except);
+		FD_SET(atom->fd, &st->fd_except);
 	}
 
 	return 0;
 }
 
 
-int io_disable(io_atom *atom, int flags)
+static int select_io_disable(io_ctx *ctx, io_atom *atom, int flags)
 {
-	if(atom->fd < 0 || atom->fd > FD_SETSIZE) {
-		return -ERANGE;
-	}
-	if(!connections[atom->fd]) {
-		return -EALREADY;
+	struct select_state *st = ctx->state;
+	int err = find(st, atom->fd);
+
+	if(err) {
+		return err;
 	}
 
 	if(flags & IO_READ) {
-		FD_CLR(atom->fd, &fd_read);
+		FD_CLR(atom->fd, &st->fd_read);
 	}
 
 	if(flags & IO_WRITE) {
-		FD_CLR(atom->fd, &fd_write);
+		FD_CLR(atom->fd, &st->fd_write);
 	}
 
 	if(flags & IO_EXCEPT) {
-		FD_CLR(atom->fd, &fd_except);
+		FD_CLR(atom->fd, &st->fd_except);
 	}
 
 	return 0;
 }
 
 
-int io_del(io_atom *atom)
+static int select_io_del(io_ctx *ctx, io_atom *atom)
 {
+	struct select_state *st = ctx->state;
 	int fd = atom->fd;
+	int err = find(st, fd);
 
-	if(fd < 0 || fd > FD_SETSIZE) {
-		return -ERANGE;
-	}
-	if(!connections[fd]) {
-		return -EALREADY;
+	if(err) {
+		return err;
 	}
 
-	install(fd, 0);
-	connections[fd] = NULL;
+	install(st, fd, 0);
+	st->connections[fd] = NULL;
 
-	while((max_fd >= 0) && (connections[max_fd] == NULL))  {
-		max_fd -= 1;
+	while((st->max_fd >= 0) && (st->connections[st->max_fd] == NULL))  {
+		st->max_fd -= 1;
 	}
 
 	return 0;
@@ -199,8 +254,9 @@ int io_del(io_atom *atom)
  * number if there was an error.
  */
 
-int io_wait(unsigned int timeout)
+static int select_io_wait(io_ctx *ctx, unsigned int timeout)
 {
+	struct select_state *st = ctx->state;
 	struct timeval tv;
 	struct timeval *tvp = &tv;
 	int ret;
@@ -212,20 +268,27 @@ int io_wait(unsigned int timeout)
 		tv.tv_usec = (timeout % 1000) * 1000;
 	}
 
-	gfd_read = fd_read;
-	gfd_write = fd_write;
-	gfd_except = fd_except;
-
-	do {
-		ret = select(1+max_fd, &gfd_read, &gfd_write, &gfd_except, tvp);
-	} while(ret < 0 && errno == EINTR);
+	st->gfd_read = st->fd_read;
+	st->gfd_write = st->fd_write;
+	st->gfd_except = st->fd_except;
+
+	ret = select(1+st->max_fd, &st->gfd_read, &st->gfd_write, &st->gfd_except, tvp);
+	if(ret < 0) {
+		// Probably interrupted by a signal.  Return so the caller can
+		// handle it right away, and make sure io_dispatch doesn't
+		// dispatch the stale sets.
+		FD_ZERO(&st->gfd_read);
+		FD_ZERO(&st->gfd_write);
+		FD_ZERO(&st->gfd_except);
+	}
 
 	return ret;
 }
 
 
-void io_dispatch()
+static void select_io_dispatch(io_ctx *ctx)
 {
+	struct select_state *st = ctx->state;
 	int i, max, flags;
 
     // Note that max_fd might change in the middle of this loop.
@@ -233,15 +296,15 @@ void io_dispatch()
     // and calls io_add, max_fd will take on the new value.  Therefore,
     // we need to loop on the value set at the start of the loop.
 
-	max = max_fd;
+	max = st->max_fd;
 	for(i=0; i <= max; i++) {
 		flags = 0;
-		if(FD_ISSET(i, &gfd_read)) flags |= IO_READ;
-		if(FD_ISSET(i, &gfd_write)) flags |= IO_WRITE;
-		if(FD_ISSET(i, &gfd_except)) flags |= IO_EXCEPT;
+		if(FD_ISSET(i, &st->gfd_read)) flags |= IO_READ;
+		if(FD_ISSET(i, &st->gfd_write)) flags |= IO_WRITE;
+		if(FD_ISSET(i, &st->gfd_except)) flags |= IO_EXCEPT;
 		if(flags) {
-			if(connections[i]) {
-				(*connections[i]->proc)(connections[i], flags);
+			if(st->connections[i]) {
+				(*st->connections[i]->proc)(st->connections[i], flags);
 			} else {
 				// what do we do -- event on an unknown connection?
 				fprintf(stderr, "io_dispatch: got an event on an uknown connection %d!?\n", i);
@@ -249,3 +312,19 @@ void io_dispatch()
 		}
 	}
 }
+
+
+const struct io_ops io_select_ops = {
+	"select",
+	0,
+	select_io_init,
+	select_io_exit,
+	select_io_exit_check,
+	select_io_add,
+	select_io_enable,
+	select_io_disable,
+	select_io_set,
+	select_io_del,
+	select_io_wait,
+	select_io_dispatch,
+};
@@ -91,6 +91,7 @@ bail:
 
 /** Creates an outgoing connection.
  *
+ * @param ctx The event loop to add the atom to.
  * @param io An uninitialized io_atom.  This call will fill it all in.
  * @param addr The address you want to connect to.
  * @param port The port you want to connect to.
@@ -103,7 +104,7 @@ bail:
  * If there was an error, you should find the reason in strerror.
  */
 
-int io_socket_connect(io_atom *io, io_proc proc, socket_addr remote, int flags)
+int io_socket_connect(io_ctx *ctx, io_atom *io, io_proc proc, socket_addr remote, int flags)
 {
 	int err;
 
@@ -113,7 +114,7 @@ int io_socket_connect(io_atom *io, io_proc proc, socket_addr remote, int flags)
 	}
 
 	io->proc = proc;
-    err = io_add(io, flags);
+    err = io_add(ctx, io, flags);
     if(err < 0) {
 		goto bail;
     }
@@ -147,7 +148,7 @@ bail:
  * there was an error.
  */
 
-int io_socket_accept(io_atom *io, io_proc proc, int flags, io_atom *listener, socket_addr *remote)
+int io_socket_accept(io_ctx *ctx, io_atom *io, io_proc proc, int flags, io_atom *listener, socket_addr *remote)
 {
     struct sockaddr_in pin;
     socklen_t plen;
@@ -177,7 +178,7 @@ int io_socket_accept(io_atom *io, io_proc proc, int flags, io_atom *listener, so
     }
 
 	io->proc = proc;
-    err = io_add(io, flags);
+    err = io_add(ctx, io, flags);
     if(err < 0) {
         close(io->fd);
         return -1;
@@ -205,7 +206,7 @@ int io_socket_accept(io_atom *io, io_proc proc, int flags, io_atom *listener, so
  * Call io_socket_close() to stop listening on the socket.
  */
 
-int io_socket_listen(io_atom *io, io_proc proc, socket_addr local)
+int io_socket_listen(io_ctx *ctx, io_atom *io, io_proc proc, socket_addr local)
 {
     struct sockaddr_in sin;
 
@@ -236,7 +237,7 @@ int io_socket_listen(io_atom *io, io_proc proc, socket_addr local)
     }
 
     io->proc = proc;
-    if(io_add(io, IO_READ) < 0) {
+    if(io_add(ctx, io, IO_READ) < 0) {
         close(io->fd);
 		return -1;
     }
@@ -245,9 +246,9 @@ int io_socket_listen(io_atom *io, io_proc proc, socket_addr local)
 }
 
 
-void io_socket_close(io_atom *io)
+void io_socket_close(io_ctx *ctx, io_atom *io)
 {
-	io_del(io);
+	io_del(ctx, io);
 	close(io->fd);
 	io->fd = -1;
 }
@@ -18,6 +18,7 @@ typedef struct {
 
 /** Sets up an outgoing connection
  *
+ * @param ctx The event loop to add the atom to.
  * @param io The io_atom to use.
  * @param proc The io_proc to give the atom.
  * @param remote the IP address and port number of the system to connect to.
@@ -27,7 +28,7 @@ typedef struct {
  * do we?
  */
 
-int io_socket_connect(io_atom *io, io_proc proc, socket_addr remote, int flags);
+int io_socket_connect(io_ctx *ctx, io_atom *io, io_proc proc, socket_addr remote, int flags);
 
 
 /** Just a lower-level version of io_socket_connect.  Returns the fd
@@ -42,6 +43,7 @@ int io_socket_connect_fd(socket_addr remote);
  *
  * You must have previously set up a listening socket using io_socket_listen.
  *
+ * @param ctx      The event loop to add the new atom to.
  * @param io       The io_atom to initialize with the new connection.
  * @param proc     The io_proc to initialize the atom with.
  * @param listener The io_atom listening for incoming connections.
@@ -50,7 +52,7 @@ int io_socket_connect_fd(socket_addr remote);
  *                 system.  Pass NULL if you don't care.
  */
 
-int io_socket_accept(io_atom *io, io_proc proc, int flags, io_atom *listener, socket_addr *remote);
+int io_socket_accept(io_ctx *ctx, io_atom *io, io_proc proc, int flags, io_atom *listener, socket_addr *remote);
 
 
 /** Sets up a socket to listen for incoming connections.
@@ -58,20 +60,21 @@ int io_socket_accept(io_atom *io, io_proc proc, int flags, io_atom *listener, so
  * Connections are passed to the io_proc using IO_READ.
  * (todo: insert example code here)
  *
+ * @param ctx The event loop to add the atom to.
  * @param io The io_atom to initialize for the new connection.
  * @param proc The io_proc to initialize the atom with.
  * @param the local IP address and port to listen on.  Use INADDR_ANY
  * 		to get the
  */
 
-int io_socket_listen(io_atom *io, io_proc proc, socket_addr local);
+int io_socket_listen(io_ctx *ctx, io_atom *io, io_proc proc, socket_addr local);
 
 
 /** Closes an open socket.  The io_atom must have been set up previously using
  * one of io_socket_connect(), io_socket_listen(), or io_socket_accept().
  */
 
-void io_socket_close(io_atom *io);
+void io_socket_close(io_ctx *ctx, io_atom *io);
 
 
 /** Reads data from a socket.
@@ -0,0 +1,208 @@
+// io_timer.c
+// Scott Bronson
+//
+// Timers for the io layer.
+//
+// The armed timers are kept on a list sorted by when they're due.
+// There are only ever a handful so there's no need for anything
+// fancier.  With timerfd, the kernel watches the clock for us: it's
+// set to go off when the first timer is due and the event loop just
+// sees it as another readable fd.  The clock is only read when a
+// timer is armed or fires, never on an ordinary trip through the loop.
+//
+// Without timerfd, io_wait's timeout is shortened so it wakes up
+// when the first timer is due.  That needs the time on each trip
+// through the loop, but only while a timer is armed.
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef IO_HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+#include "io.h"
+
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+#ifdef IO_HAVE_TIMERFD
+
+/** Sets the timerfd to go off when the first timer is due. */
+
+static void rearm(io_ctx *ctx)
+{
+	struct itimerspec its;
+
+	if(ctx->timer_fd < 0) {
+		return;
+	}
+
+	// A zero it_value disarms the timerfd.
+	memset(&its, 0, sizeof(its));
+	if(ctx->timers) {
+		its.it_value.tv_sec = ctx->timers->when / 1000;
+		its.it_value.tv_nsec = (ctx->timers->when % 1000) * 1000000;
+	}
+
+	timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+#else
+
+#define rearm(ctx)
+
+#endif
+
+
+/** Calls every timer that has come due. */
+
+static void run_timers(io_ctx *ctx)
+{
+	long long now = now_ms();
+	io_timer *timer;
+
+	while(ctx->timers && ctx->timers->when <= now) {
+		timer = ctx->timers;
+		ctx->timers = timer->next;
+		timer->next = NULL;
+		timer->when = 0;
+		// the proc is free to arm the timer again.
+		(*timer->proc)(timer);
+	}
+
+	rearm(ctx);
+}
+
+
+#ifdef IO_HAVE_TIMERFD
+
+static void timer_proc(io_atom *atom, int flags)
+{
+	io_ctx *ctx = (io_ctx*)((char*)atom - offsetof(io_ctx, timer_atom));
+	uint64_t expirations;
+
+	if(read(atom->fd, &expirations, sizeof(expirations)) < 0) {
+		// EAGAIN: the timer was rearmed after it went off.
+		return;
+	}
+
+	run_timers(ctx);
+}
+
+#endif
+
+
+/** Called by io_init after the backend has started. */
+
+void io_timer_start(io_ctx *ctx)
+{
+	ctx->timer_fd = -1;
+
+#ifdef IO_HAVE_TIMERFD
+	ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(ctx->timer_fd < 0) {
+		// fall back to shortening io_wait's timeout
+		return;
+	}
+
+	io_atom_init(&ctx->timer_atom, ctx->timer_fd, timer_proc);
+	if(io_add(ctx, &ctx->timer_atom, IO_READ) < 0) {
+		close(ctx->timer_fd);
+		ctx->timer_fd = -1;
+		return;
+	}
+
+	rearm(ctx);
+#endif
+}
+
+
+/** Called by io_exit before the backend is shut down. */
+
+void io_timer_stop(io_ctx *ctx)
+{
+	if(ctx->timer_fd >= 0) {
+		io_del(ctx, &ctx->timer_atom);
+		close(ctx->timer_fd);
+		ctx->timer_fd = -1;
+	}
+}
+
+
+/** Returns how long io_wait should wait, given that the caller
+ *  asked for timeout.
+ */
+
+unsigned int io_timer_timeout(io_ctx *ctx, unsigned int timeout)
+{
+	long long ms;
+
+	if(ctx->timer_fd >= 0 || !ctx->timers) {
+		return timeout;
+	}
+
+	ms = ctx->timers->when - now_ms();
+	if(ms < 0) {
+		ms = 0;
+	}
+
+	return ms < timeout ? (unsigned int)ms : timeout;
+}
+
+
+/** Called by io_dispatch after it has dispatched all the events. */
+
+void io_timer_dispatch(io_ctx *ctx)
+{
+	if(ctx->timer_fd < 0 && ctx->timers) {
+		run_timers(ctx);
+	}
+}
+
+
+int io_timer_add(io_ctx *ctx, io_timer *timer, unsigned int ms)
+{
+	io_timer **pp;
+
+	io_timer_del(ctx, timer);
+	timer->when = now_ms() + ms;
+
+	for(pp = &ctx->timers; *pp && (*pp)->when <= timer->when; pp = &(*pp)->next) {
+		// find the insertion point
+	}
+	timer->next = *pp;
+	*pp = timer;
+
+	if(ctx->timers == timer) {
+		rearm(ctx);
+	}
+
+	return 0;
+}
+
+
+void io_timer_del(io_ctx *ctx, io_timer *timer)
+{
+	io_timer **pp;
+
+	for(pp = &ctx->timers; *pp; pp = &(*pp)->next) {
+		if(*pp == timer) {
+			*pp = timer->next;
+			timer->next = NULL;
+			timer->when = 0;
+			// If it was first, the timerfd goes off a little early
+			// and finds nothing to do.  Not worth a syscall.
+			return;
+		}
+	}
+}
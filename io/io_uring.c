@@ -0,0 +1,784 @@
+// io_uring.c
+// Scott Bronson
+//
+// Uses io_uring to satisfy gatekeeper's network I/O
+//
+// Each watched fd gets a oneshot IORING_OP_POLL_ADD.  When it fires,
+// the fd is re-armed the next time through io_wait, which gives the
+// same level-triggered behavior as select.  io_enable, io_disable and
+// friends never make a syscall: they just note that the fd needs its
+// poll updated.  All the updates are submitted by the same
+// io_uring_enter that waits for the next batch of events.
+//
+// io_transfer does the reads and writes themselves.  Each one is a
+// POLL_ADD linked to a READV or WRITEV on the caller's buffers.  The
+// fds are nonblocking, so without the poll an fd that isn't ready
+// would just fail with EAGAIN.  The transfers are submitted along with
+// the polls, so a single io_uring_enter can start every read and write
+// the last dispatch asked for, do the ones that are ready right then,
+// and wait for the rest.  Their completions are dispatched like events.
+//
+// This talks to the kernel directly so it doesn't need liburing.
+// Linux 5.11 or later is required (for IORING_FEAT_EXT_ARG).
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "io.h"
+
+
+// number of submission queue entries.  If more updates than this
+// pile up, they're submitted early (without waiting).
+#define RING_ENTRIES 128
+
+// the fd table grows by this many entries at a time.
+#define FD_INCREMENT 64
+
+// user_data for POLL_REMOVE and ASYNC_CANCEL requests.  Their
+// completions are ignored.
+#define REMOVE_TAG (~(uint64_t)0)
+
+// The low two bits of the user_data tell what a completion is for.
+// A poll for an atom has them clear (see poll_tag).  A transfer's
+// user_data is the address of its io_xfer with one of these set.
+#define TAG_MASK 3
+#define XFER_OP 1		// the READV or WRITEV
+#define XFER_POLL 2		// the poll it's linked to (ignored)
+
+
+struct uring_conn {
+	io_atom *atom;		// the atom watching this fd or NULL
+	int flags;			// the IO_ flags the atom is interested in
+	int armed;			// the IO_ flags of the poll that's in the kernel, 0 if none
+	uint32_t gen;		// identifies the armed poll so stale completions can be ignored
+	int dirty;			// 1 if the fd is on the dirty list
+};
+
+
+// everything the backend keeps for one io_ctx
+struct uring_state {
+	int ringfd;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_conn *connections;	// indexed by fd
+	int max_connections;
+
+	int *dirty;				// fds whose poll needs to be updated
+	int num_dirty;
+
+	struct pollfd *ready;	// events found by io_wait for io_dispatch
+	int num_ready;
+	int max_ready;
+
+	io_xfer **done;			// finished transfers for io_dispatch (NULL if cancelled)
+	int num_done;
+	int num_xfers;			// transfers that are busy, so the most that can be on done
+	int max_done;
+
+	pid_t pid;				// the process that owns the ring (see uring_io_cancel)
+};
+
+
+static int ring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static void* ring_map(struct uring_state *st, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, st->ringfd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+
+static int ring_enter(struct uring_state *st, unsigned submit,
+		unsigned complete, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, st->ringfd, submit, complete,
+			flags, arg, argsz);
+}
+
+
+static void ring_close(struct uring_state *st);
+
+
+static int uring_io_init(io_ctx *ctx)
+{
+	struct io_uring_params p;
+	struct uring_state *st;
+	int err;
+
+	st = calloc(1, sizeof(struct uring_state));
+	if(st == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(&p, 0, sizeof(p));
+	st->ringfd = ring_setup(RING_ENTRIES, &p);
+	if(st->ringfd < 0) {
+		err = -errno;
+		free(st);
+		return err;
+	}
+	if(!(p.features & IORING_FEAT_EXT_ARG)) {
+		// kernel is too old
+		close(st->ringfd);
+		free(st);
+		return -ENOSYS;
+	}
+
+	st->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	st->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(st->cq_ring_size > st->sq_ring_size) {
+			st->sq_ring_size = st->cq_ring_size;
+		}
+		st->cq_ring_size = st->sq_ring_size;
+	}
+
+	st->sq_ring = ring_map(st, st->sq_ring_size, IORING_OFF_SQ_RING);
+	st->cq_ring = st->sq_ring;
+	if(st->sq_ring && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		st->cq_ring = ring_map(st, st->cq_ring_size, IORING_OFF_CQ_RING);
+	}
+	st->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	st->sqes = ring_map(st, st->sqes_size, IORING_OFF_SQES);
+
+	if(!st->sq_ring || !st->cq_ring || !st->sqes) {
+		ring_close(st);
+		free(st);
+		return -ENOMEM;
+	}
+
+	st->sq_head = (unsigned*)((char*)st->sq_ring + p.sq_off.head);
+	st->sq_tail = (unsigned*)((char*)st->sq_ring + p.sq_off.tail);
+	st->sq_mask = (unsigned*)((char*)st->sq_ring + p.sq_off.ring_mask);
+	st->sq_array = (unsigned*)((char*)st->sq_ring + p.sq_off.array);
+	st->cq_head = (unsigned*)((char*)st->cq_ring + p.cq_off.head);
+	st->cq_tail = (unsigned*)((char*)st->cq_ring + p.cq_off.tail);
+	st->cq_mask = (unsigned*)((char*)st->cq_ring + p.cq_off.ring_mask);
+	st->cqes = (struct io_uring_cqe*)((char*)st->cq_ring + p.cq_off.cqes);
+
+	st->pid = getpid();
+	ctx->state = st;
+	return 0;
+}
+
+
+/** The rings are shared memory, so a forked child mustn't touch
+ *  them.  It's fine for it to unmap them and close the ring though.
+ */
+
+static void ring_close(struct uring_state *st)
+{
+	if(st->ringfd < 0) {
+		return;
+	}
+
+	if(st->sqes) {
+		munmap(st->sqes, st->sqes_size);
+	}
+	if(st->cq_ring && st->cq_ring != st->sq_ring) {
+		munmap(st->cq_ring, st->cq_ring_size);
+	}
+	if(st->sq_ring) {
+		munmap(st->sq_ring, st->sq_ring_size);
+	}
+	st->sqes = NULL;
+	st->sq_ring = st->cq_ring = NULL;
+	close(st->ringfd);
+	st->ringfd = -1;
+}
+
+
+static void uring_io_exit(io_ctx *ctx)
+{
+	ring_close(ctx->state);
+}
+
+
+static int uring_io_exit_check(io_ctx *ctx)
+{
+	struct uring_state *st = ctx->state;
+	int cnt = 0;
+	int i;
+
+	// Check that we haven't leaked any atoms.
+	for(i=0; i<st->max_connections; i++) {
+		if(st->connections[i].atom) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)st->connections[i].atom);
+			cnt += 1;
+		}
+	}
+	if(st->num_xfers) {
+		fprintf(stderr, "Leaked %d transfers!\n", st->num_xfers);
+		cnt += st->num_xfers;
+	}
+
+	return cnt;
+}
+
+
+static int grow_connections(struct uring_state *st, int fd)
+{
+	int max = (fd + FD_INCREMENT) / FD_INCREMENT * FD_INCREMENT;
+	struct uring_conn *conn;
+	int *nd;
+	struct pollfd *nr;
+
+	conn = realloc(st->connections, max * sizeof(struct uring_conn));
+	if(conn == NULL) {
+		return -ENOMEM;
+	}
+	memset(conn + st->max_connections, 0,
+			(max - st->max_connections) * sizeof(struct uring_conn));
+	st->connections = conn;
+
+	// an fd can only be on the dirty list once, and only has one
+	// armed poll, so these never need to be bigger than the fd table.
+	nd = realloc(st->dirty, max * sizeof(int));
+	if(nd == NULL) {
+		return -ENOMEM;
+	}
+	st->dirty = nd;
+
+	nr = realloc(st->ready, max * sizeof(struct pollfd));
+	if(nr == NULL) {
+		return -ENOMEM;
+	}
+	st->ready = nr;
+
+	st->max_connections = max;
+	st->max_ready = max;
+	return 0;
+}
+
+
+static void mark_dirty(struct uring_state *st, int fd)
+{
+	if(!st->connections[fd].dirty) {
+		st->connections[fd].dirty = 1;
+		st->dirty[st->num_dirty++] = fd;
+	}
+}
+
+
+/** Returns the next free SQE, submitting the queued ones first if
+ *  the ring is full.  The kernel only looks at the ring during
+ *  io_uring_enter (we don't use SQPOLL) so it's fine for the caller
+ *  to fill in the SQE after the tail has been bumped.
+ */
+
+static unsigned sq_pending(struct uring_state *st)
+{
+	return *st->sq_tail - __atomic_load_n(st->sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+/** Makes sure the next n SQEs fit in the ring, so linked SQEs don't
+ *  get split across two submissions.
+ */
+
+static void sq_reserve(struct uring_state *st, unsigned n)
+{
+	if(sq_pending(st) + n > *st->sq_mask + 1) {
+		// the ring is full.  Hand what we have to the kernel.
+		ring_enter(st, sq_pending(st), 0, 0, NULL, 0);
+	}
+}
+
+
+static struct io_uring_sqe* get_sqe(struct uring_state *st)
+{
+	unsigned tail = *st->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	sq_reserve(st, 1);
+
+	sqe = &st->sqes[tail & *st->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	st->sq_array[tail & *st->sq_mask] = tail & *st->sq_mask;
+	__atomic_store_n(st->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+
+static uint64_t poll_tag(int fd, uint32_t gen)
+{
+	return ((uint64_t)gen << 32) | ((uint32_t)fd << 2);
+}
+
+
+static uint64_t xfer_tag(io_xfer *xfer, int part)
+{
+	return (uint64_t)(uintptr_t)xfer | part;
+}
+
+
+/** Brings the kernel's poll for the fd in line with its flags. */
+
+static void update(struct uring_state *st, int fd)
+{
+	struct uring_conn *conn = &st->connections[fd];
+	int want = conn->atom ? conn->flags : 0;
+	struct io_uring_sqe *sqe;
+
+	conn->dirty = 0;
+
+	if(want == conn->armed) {
+		return;
+	}
+
+	if(conn->armed) {
+		sqe = get_sqe(st);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = poll_tag(fd, conn->gen);
+		sqe->user_data = REMOVE_TAG;
+		conn->armed = 0;
+	}
+
+	// Whether or not the remove succeeds, completions from the
+	// old poll will now be ignored.
+	conn->gen += 1;
+
+	if(want) {
+		sqe = get_sqe(st);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		if(want & IO_READ) sqe->poll32_events |= POLLIN;
+		if(want & IO_WRITE) sqe->poll32_events |= POLLOUT;
+		if(want & IO_EXCEPT) sqe->poll32_events |= POLLPRI;
+		sqe->user_data = poll_tag(fd, conn->gen);
+		conn->armed = want;
+	}
+}
+
+
+static struct uring_conn* find(struct uring_state *st, io_atom *atom)
+{
+	if(atom->fd < 0 || atom->fd >= st->max_connections) {
+		return NULL;
+	}
+
+	return &st->connections[atom->fd];
+}
+
+
+static int uring_io_add(io_ctx *ctx, io_atom *atom, int flags)
+{
+	struct uring_state *st = ctx->state;
+	int fd = atom->fd;
+	int err;
+
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(fd >= st->max_connections) {
+		err = grow_connections(st, fd);
+		if(err) {
+			return err;
+		}
+	}
+	if(st->connections[fd].atom) {
+		return -EALREADY;
+	}
+
+	// If a previous atom on this fd still has a poll armed,
+	// update() will remove it.
+	st->connections[fd].atom = atom;
+	st->connections[fd].flags = flags;
+	mark_dirty(st, fd);
+
+	return 0;
+}
+
+
+static int uring_io_set(io_ctx *ctx, io_atom *atom, int flags)
+{
+	struct uring_state *st = ctx->state;
+	struct uring_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	conn->flags = flags;
+	mark_dirty(st, atom->fd);
+	return 0;
+}
+
+
+static int uring_io_enable(io_ctx *ctx, io_atom *atom, int flags)
+{
+	struct uring_state *st = ctx->state;
+	struct uring_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	if((conn->flags & flags) != flags) {
+		conn->flags |= flags;
+		mark_dirty(st, atom->fd);
+	}
+	return 0;
+}
+
+
+static int uring_io_disable(io_ctx *ctx, io_atom *atom, int flags)
+{
+	struct uring_state *st = ctx->state;
+	struct uring_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	if(conn->flags & flags) {
+		conn->flags &= ~flags;
+		mark_dirty(st, atom->fd);
+	}
+	return 0;
+}
+
+
+static int uring_io_del(io_ctx *ctx, io_atom *atom)
+{
+	struct uring_state *st = ctx->state;
+	struct uring_conn *conn = find(st, atom);
+
+	if(conn == NULL) {
+		return -ERANGE;
+	}
+	if(!conn->atom) {
+		return -EALREADY;
+	}
+
+	// The armed poll (if any) is removed by the next io_wait.
+	// A forked child never calls io_wait so it can't disturb
+	// the parent's ring.
+	conn->atom = NULL;
+	conn->flags = 0;
+	mark_dirty(st, atom->fd);
+
+	return 0;
+}
+
+
+static int uring_io_transfer(io_ctx *ctx, io_atom *atom, io_xfer *xfer, int flags)
+{
+	struct uring_state *st = ctx->state;
+	struct io_uring_sqe *sqe;
+	io_xfer **nd;
+	int max;
+
+	if(xfer->busy) {
+		return -EALREADY;
+	}
+	if(atom->fd < 0) {
+		return -ERANGE;
+	}
+
+	// Make sure there will be room to report it when it's done.
+	// Cancelled transfers leave holes in the list until the next
+	// dispatch, so every busy transfer might still need a slot.
+	if(st->num_done + st->num_xfers >= st->max_done) {
+		max = st->max_done + FD_INCREMENT;
+		nd = realloc(st->done, max * sizeof(io_xfer*));
+		if(nd == NULL) {
+			return -ENOMEM;
+		}
+		st->done = nd;
+		st->max_done = max;
+	}
+
+	sq_reserve(st, 2);
+
+	sqe = get_sqe(st);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = atom->fd;
+	sqe->poll32_events = (flags & IO_READ) ? POLLIN : POLLOUT;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = xfer_tag(xfer, XFER_POLL);
+
+	sqe = get_sqe(st);
+	sqe->opcode = (flags & IO_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->fd = atom->fd;
+	sqe->addr = (uint64_t)(uintptr_t)xfer->iov;
+	sqe->len = xfer->iovcnt;
+	sqe->off = (uint64_t)-1;	// wherever the file is, like readv
+	sqe->user_data = xfer_tag(xfer, XFER_OP);
+
+	xfer->atom = atom;
+	xfer->flags = flags & (IO_READ | IO_WRITE);
+	xfer->result = 0;
+	xfer->done = 0;
+	xfer->busy = 1;
+	st->num_xfers += 1;
+
+	return 0;
+}
+
+
+static void reap(struct uring_state *st)
+{
+	unsigned head = *st->cq_head;
+	unsigned tail = __atomic_load_n(st->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct uring_conn *conn;
+	io_xfer *xfer;
+	int fd;
+
+	while(head != tail) {
+		cqe = &st->cqes[head & *st->cq_mask];
+		head += 1;
+
+		if(cqe->user_data & TAG_MASK) {
+			// If the poll in front of a transfer fails (it was
+			// cancelled), so does the transfer, so only its
+			// completion matters.
+			if((cqe->user_data & TAG_MASK) == XFER_OP) {
+				xfer = (io_xfer*)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+				xfer->result = cqe->res;
+				xfer->done = 1;
+				st->done[st->num_done++] = xfer;
+			}
+			continue;
+		}
+
+		fd = (int)((uint32_t)cqe->user_data >> 2);
+		if(fd >= st->max_connections) {
+			continue;
+		}
+		conn = &st->connections[fd];
+		if((uint32_t)(cqe->user_data >> 32) != conn->gen || !conn->armed) {
+			// a poll that has since been removed or replaced
+			continue;
+		}
+
+		// oneshot: the poll is gone.  Re-arm it next time.
+		conn->armed = 0;
+		mark_dirty(st, fd);
+
+		if(cqe->res > 0 && st->num_ready < st->max_ready) {
+			st->ready[st->num_ready].fd = fd;
+			st->ready[st->num_ready].revents = cqe->res;
+			st->num_ready += 1;
+		}
+	}
+
+	__atomic_store_n(st->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/** Gets the buffers back from a transfer.  It's not enough to ask the
+ *  kernel to cancel it; we have to wait until it says it's done.
+ */
+
+static void uring_io_cancel(io_ctx *ctx, io_xfer *xfer)
+{
+	struct uring_state *st = ctx->state;
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if(st->ringfd < 0 || getpid() != st->pid) {
+		// A forked child (or a ring that's been shut down) can't
+		// touch the ring.  The parent still owns the transfer.
+		xfer->busy = 0;
+		xfer->result = -ECANCELED;
+		st->num_xfers -= 1;
+		return;
+	}
+
+	if(!xfer->done) {
+		// Cancelling the poll cancels the transfer linked to it.
+		// If the poll has already fired, the transfer is running.
+		sq_reserve(st, 2);
+		sqe = get_sqe(st);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = xfer_tag(xfer, XFER_POLL);
+		sqe->user_data = REMOVE_TAG;
+		sqe = get_sqe(st);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = xfer_tag(xfer, XFER_OP);
+		sqe->user_data = REMOVE_TAG;
+
+		// Anything else that completes meanwhile is dispatched as usual.
+		while(!xfer->done) {
+			if(ring_enter(st, sq_pending(st), 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+					errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				fprintf(stderr, "Could not cancel a transfer: %s\n", strerror(errno));
+				break;
+			}
+			reap(st);
+		}
+	}
+
+	for(i=0; i<st->num_done; i++) {
+		if(st->done[i] == xfer) {
+			st->done[i] = NULL;
+		}
+	}
+
+	xfer->busy = 0;
+	st->num_xfers -= 1;
+}
+
+
+/** Waits for events.  See io_dispatch to dispatch the events.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds.  INT_MAX is special-cased to mean forever.
+ *
+ * @returns the number of events to be dispatched or a negative
+ * number if there was an error.
+ */
+
+static int uring_io_wait(io_ctx *ctx, unsigned int timeout)
+{
+	struct uring_state *st = ctx->state;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int i, ret, cnt = st->num_dirty;
+
+	if(st->num_ready || st->num_done) {
+		// io_cancel turned these up since the last dispatch.
+		// Hand them out before waiting for more.
+		return st->num_ready + st->num_done;
+	}
+
+	// Queue up every change made since the last wait.
+	st->num_dirty = 0;
+	for(i=0; i<cnt; i++) {
+		update(st, st->dirty[i]);
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	if(timeout != INT_MAX) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	// Submit everything the kernel hasn't consumed yet (including
+	// any left over from an interrupted call) and wait, in one syscall.
+	ret = ring_enter(st, sq_pending(st),
+			1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+
+	reap(st);
+
+	if(ret < 0 && errno != ETIME && !st->num_ready && !st->num_done) {
+		// Probably interrupted by a signal.  Return so the
+		// caller can handle it.
+		return -1;
+	}
+
+	return st->num_ready + st->num_done;
+}
+
+
+static void uring_io_dispatch(io_ctx *ctx)
+{
+	struct uring_state *st = ctx->state;
+	int i, fd, flags;
+	short ev;
+	struct uring_conn *conn;
+	io_xfer *xfer;
+
+	for(i=0; i<st->num_ready; i++) {
+		fd = st->ready[i].fd;
+		conn = &st->connections[fd];
+
+		// the atom may have been removed by a proc that we
+		// dispatched earlier in this loop.
+		if(!conn->atom) {
+			continue;
+		}
+
+		ev = st->ready[i].revents;
+		flags = 0;
+		if(ev & POLLIN) flags |= IO_READ;
+		if(ev & POLLOUT) flags |= IO_WRITE;
+		if(ev & POLLPRI) flags |= IO_EXCEPT;
+		if(ev & (POLLERR | POLLHUP | POLLNVAL)) {
+			// select reports these as readable/writable so the
+			// proc discovers the EOF or error when it does the i/o.
+			flags |= IO_READ | IO_WRITE;
+		}
+
+		flags &= conn->flags;
+		if(flags) {
+			(*conn->atom->proc)(conn->atom, flags);
+		}
+	}
+
+	st->num_ready = 0;
+
+	// A proc may cancel a transfer further down the list (it's set
+	// to NULL) or add more to the end (io_cancel reaps).
+	for(i=0; i<st->num_done; i++) {
+		xfer = st->done[i];
+		if(!xfer) {
+			continue;
+		}
+		st->done[i] = NULL;
+		xfer->busy = 0;
+		st->num_xfers -= 1;
+		(*xfer->atom->proc)(xfer->atom, xfer->flags | IO_DONE);
+	}
+
+	st->num_done = 0;
+}
+
+
+const struct io_ops io_uring_ops = {
+	"uring",
+	0,
+	uring_io_init,
+	uring_io_exit,
+	uring_io_exit_check,
+	uring_io_add,
+	uring_io_enable,
+	uring_io_disable,
+	uring_io_set,
+	uring_io_del,
+	uring_io_wait,
+	uring_io_dispatch,
+	uring_io_transfer,
+	uring_io_cancel,
+};
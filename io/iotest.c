@@ -29,6 +29,7 @@
 #define PORT 21314
 
 
+io_ctx *g_io;         // the event loop
 io_atom g_accepter;   // the listening socket
 char g_char = 'A';
 char g_readbuf[1024];
@@ -63,7 +64,7 @@ int set_nonblock(int sd)
 
 void connection_close(connection *conn)
 {
-	io_del(&conn->io);
+	io_del(g_io, &conn->io);
 	close(conn->io.fd);
 	free(conn);
 }
@@ -158,7 +159,7 @@ void accept_proc(io_atom *ioa, int flags)
 	conn->io.fd = sd;
 	conn->io.proc = connection_proc;
 
-	if(io_add(&conn->io, IO_READ) < 0) {
+	if(io_add(g_io, &conn->io, IO_READ) < 0) {
 		perror("io_add_main");
 		close(sd);
 		exit(1);
@@ -174,7 +175,7 @@ int main(int argc, char **argv)
 	int sd;
 	struct sockaddr_in sin;
 
-	io_init();
+	g_io = io_init();
 
 	printf("Opening listening socket...\n");
 
@@ -209,7 +210,7 @@ int main(int argc, char **argv)
 	g_accepter.fd = sd;
 	g_accepter.proc = accept_proc;
 
-	if(io_add(&g_accepter, IO_READ) < 0) {
+	if(io_add(g_io, &g_accepter, IO_READ) < 0) {
 		perror("io_add_main");
 		close(sd);
 		exit(1);
@@ -218,10 +219,11 @@ int main(int argc, char **argv)
 	printf("Listening on port %d, fd %d.\n", PORT, g_accepter.fd);
 
 	for(;;) {
-		io_wait(INT_MAX);
+		io_wait(g_io, INT_MAX);
+		io_dispatch(g_io);
 	}
 
-	io_exit();
+	io_exit(g_io);
 
 	return 0;
 }
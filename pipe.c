@@ -13,14 +13,52 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "fifo.h"
 #include "io/io.h"
 #include "log.h"
 #include "pipe.h"
+#include "pool.h"
 #include "util.h"
 
 
+// When a pipe's input becomes readable, we keep reading until it
+// runs dry (EAGAIN).  These limit how much we'll read in a single
+// wakeup so a fast producer can't starve the other direction.
+int pipe_read_budget = 32;				// most reads per wakeup
+int pipe_byte_budget = 256*1024;		// most bytes per wakeup
+
+// If the io backend is edge-triggered, every pipe atom is registered
+// for both reading and writing once, when it's created, and never
+// touched again.  Instead of turning interest on and off, the pipe
+// remembers in pipe_atom::ready which directions the fd has signalled
+// and keeps doing i/o until the fd says EAGAIN.  A bulk transfer then
+// runs without changing the interest set at all.
+
+// If the io backend can do the i/o itself (io_uring, see io_transfer),
+// nothing is watched.  The pipe keeps a read queued into the fifo's
+// free space and, while there's data, a write queued from it.  The
+// kernel owns those parts of the fifo until the transfer comes back,
+// so anything else that wants to rearrange the fifo (pipe_writev, a
+// mark proc, resizing it, a task switch) calls pipe_quiesce first to
+// get them back and pipe_resume afterward.  Appending is fine.
+
+
+// What a cancelled read brought in is kept in a chain of these
+// (see pipe_park) so parking doesn't have to malloc.
+#define PIPE_PARK_SEG 16384
+
+struct pipe_park_seg {
+	struct pipe_park_seg *next;
+	int len;
+	char data[PIPE_PARK_SEG];
+};
+
+static __thread struct pool park_pool = POOL_INIT("pipe_park_seg", struct pipe_park_seg);
+
+
 int set_nonblock(int fd)
 {
 	int i;
@@ -34,12 +72,306 @@ int set_nonblock(int fd)
 }
 
 
-/** Calls fifo_read and handles the case if it returns an EOF.
+static double pipe_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Tells if the pipe's atoms are watched by turning IO_READ and
+ *  IO_WRITE on and off.  Edge-triggered atoms are watched all the
+ *  time, and if the backend does the i/o, they aren't watched at all.
  */
 
-static int pipe_fifo_read(struct pipe *pipe)
+static int pipe_toggles(io_ctx *io)
+{
+	return !io_edge_triggered(io) && !io_can_transfer(io);
+}
+
+
+/** Stops reading from the pipe's input until pipe_unblock_read
+ *  is called.  Called when the fifo is full and can't grow.
+ */
+
+static void pipe_block_read(struct pipe *pipe)
+{
+	if(pipe_toggles(pipe->io)) {
+		io_disable(pipe->io, &pipe->read_atom->atom, IO_READ);
+	}
+	pipe->block_read = 1;
+	pipe->stats.stalls += 1;
+	pipe->stats.blocked_since = pipe_now();
+}
+
+
+/** Marks the pipe as readable again.  The caller is responsible for
+ *  re-enabling IO_READ on whatever atom is now the read side (or, if
+ *  edge-triggered, for getting back to it with io_pend).
+ */
+
+void pipe_unblock_read(struct pipe *pipe)
+{
+	if(pipe->block_read) {
+		pipe->stats.blocked_time += pipe_now() - pipe->stats.blocked_since;
+		pipe->block_read = 0;
+	}
+}
+
+
+/** Copies what a cancelled read brought in out of the fifo's free
+ *  space, which is about to be used for something else.  It goes
+ *  through the fifo later, from the event loop (see pipe_unpark).
+ *  An EOF is parked as a single empty segment.
+ */
+
+static void pipe_park(pipe_atom *atom)
+{
+	struct pipe_park_seg **tail = &atom->parked;
+	struct pipe_park_seg *seg;
+	int cnt = atom->rx.result;
+	int i = 0, off = 0, len;
+
+	atom->parked_cnt = cnt;
+
+	do {
+		seg = pool_alloc(&park_pool);
+		if(seg == NULL) {
+			perror("parking a read");
+			bail(96);
+		}
+		seg->next = NULL;
+		seg->len = 0;
+		*tail = seg;
+		tail = &seg->next;
+
+		while(cnt > 0 && seg->len < PIPE_PARK_SEG) {
+			len = atom->rx.iov[i].iov_len - off;
+			if(len > cnt) len = cnt;
+			if(len > PIPE_PARK_SEG - seg->len) len = PIPE_PARK_SEG - seg->len;
+			memcpy(seg->data + seg->len, (char*)atom->rx.iov[i].iov_base + off, len);
+			seg->len += len;
+			cnt -= len;
+			off += len;
+			if(off == (int)atom->rx.iov[i].iov_len) {
+				i += 1;
+				off = 0;
+			}
+		}
+	} while(cnt > 0);
+}
+
+
+static void pipe_park_free(pipe_atom *atom)
+{
+	struct pipe_park_seg *seg, *next;
+
+	for(seg = atom->parked; seg; seg = next) {
+		next = seg->next;
+		pool_free(&park_pool, seg);
+	}
+	atom->parked = NULL;
+}
+
+
+static void pipe_quiesce_read(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->read_atom;
+
+	if(!atom || atom->atom.fd < 0 || !atom->rx.busy) {
+		return;
+	}
+
+	io_cancel(pipe->io, &atom->rx);
+	if(atom->rx.result >= 0) {
+		// too late, it read something (or the EOF)
+		pipe_park(atom);
+	}
+}
+
+
+static void pipe_quiesce_write(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->write_atom;
+	int cnt;
+
+	if(!atom || atom->atom.fd < 0 || !atom->tx.busy) {
+		return;
+	}
+
+	io_cancel(pipe->io, &atom->tx);
+	cnt = atom->tx.result;
+	if(cnt > 0) {
+		// Too late, it wrote something.  Take it out of the fifo
+		// now.  The rest of what a write does (reaching the mark,
+		// unblocking the reader) happens when the writer runs.
+		fifo_write_done(&pipe->fifo, atom->atom.fd, atom->tx.iov, cnt);
+		pipe->bytes_written += cnt;
+		io_pend(pipe->io, &atom->atom, IO_WRITE);
+	}
+}
+
+
+/** Gets the fifo's buffers back from the kernel by cancelling the
+ *  pipe's read and write if they're in flight.  Call it before doing
+ *  anything to the fifo but appending to it, then call pipe_resume.
+ *  Does nothing unless the backend is doing the pipe's i/o.
+ */
+
+void pipe_quiesce(struct pipe *pipe)
+{
+	pipe_quiesce_write(pipe);
+	pipe_quiesce_read(pipe);
+}
+
+
+/** Queues a write of whatever is in the fifo (up to the mark) unless
+ *  the writer is already busy.
+ */
+
+static void pipe_post_write(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->write_atom;
+	int err;
+
+	if(!atom || atom->atom.fd < 0 || atom->tx.busy) {
+		return;
+	}
+
+	atom->tx.iovcnt = fifo_write_iov(&pipe->fifo, atom->tx.iov);
+	if(!atom->tx.iovcnt) {
+		if(pipe->fifo.mark_proc && pipe->fifo.beg == pipe->fifo.mark) {
+			// drained to the mark.  pipe_fifo_write will notice.
+			io_pend(pipe->io, &atom->atom, IO_WRITE);
+		}
+		return;
+	}
+
+	err = io_transfer(pipe->io, &atom->atom, &atom->tx, IO_WRITE);
+	if(err) {
+		log_warn("Could not queue a write to %d: %s",
+				atom->atom.fd, strerror(-err));
+	}
+}
+
+
+/** Queues a read into the fifo's free space unless the reader is
+ *  already busy, blocked, or off being a verso.
+ */
+
+static void pipe_post_read(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->read_atom;
+	struct fifo *f = &pipe->fifo;
+	int err;
+
+	if(!atom || atom->atom.fd < 0 || atom->rx.busy || pipe->block_read ||
+			atom->atom.proc != pipe_io_proc) {
+		return;
+	}
+
+	if(atom->parked) {
+		// what was read before has to go first
+		io_pend(pipe->io, &atom->atom, IO_READ);
+		return;
+	}
+
+	atom->rx.iovcnt = fifo_read_iov(f, atom->rx.iov);
+	if(!atom->rx.iovcnt && f->size < f->maxsize) {
+		// No room, so grow the fifo.  It moves, so the writer
+		// has to hand back its buffers first.
+		pipe_quiesce_write(pipe);
+		fifo_inflate(f);
+		pipe_post_write(pipe);
+		atom->rx.iovcnt = fifo_read_iov(f, atom->rx.iov);
+	}
+	if(atom->rx.iovcnt && pipe->write_atom && pipe->write_atom->tx.busy &&
+			fifo_avail(f) - f->hold < BUFSIZ) {
+		// A read into what's left of a small fifo would chop the data
+		// into slivers, and zrq lets go of a start sequence that's cut
+		// off at the end of a packet.  Wait for the write to finish.
+		return;
+	}
+	if(!atom->rx.iovcnt) {
+		// We'll read again when the writer makes some room.
+		log_dbg("fifo is full! Not reading %d", atom->atom.fd);
+		pipe_block_read(pipe);
+		return;
+	}
+
+	err = io_transfer(pipe->io, &atom->atom, &atom->rx, IO_READ);
+	if(err) {
+		log_warn("Could not queue a read from %d: %s",
+				atom->atom.fd, strerror(-err));
+	}
+}
+
+
+/** Gets the pipe's i/o going again after pipe_quiesce (or anything
+ *  else that might have left it idle).  Does nothing unless the
+ *  backend is doing the pipe's i/o.
+ */
+
+void pipe_resume(struct pipe *pipe)
+{
+	if(!io_can_transfer(pipe->io) || pipe->in_proc) {
+		return;
+	}
+
+	pipe_post_write(pipe);
+	pipe_post_read(pipe);
+}
+
+
+/** Changes the size the pipe's fifo shrinks back to (see
+ *  fifo_set_minsize).  The fifo may move, so its buffers are taken
+ *  back from the kernel first.
+ *
+ *  If one of the fifo's procs is running (a new task is usually
+ *  installed from inside the scanner), the proc may still be looking
+ *  at data in the fifo's buffer.  Then the change waits until the
+ *  proc returns (see pipe_proc_done).
+ */
+
+int pipe_set_minsize(struct pipe *pipe, int size)
+{
+	int ret;
+
+	if(pipe->in_proc) {
+		pipe->new_minsize = size;
+		return 1;
+	}
+
+	pipe_quiesce(pipe);
+	ret = fifo_set_minsize(&pipe->fifo, size);
+	pipe_resume(pipe);
+
+	return ret;
+}
+
+
+/** Called when a fifo proc or mark proc returns.  Applies a minsize
+ *  that pipe_set_minsize had to put off.  The caller resumes the pipe.
+ */
+
+static void pipe_proc_done(struct pipe *pipe)
+{
+	pipe->in_proc -= 1;
+	if(!pipe->in_proc && pipe->new_minsize) {
+		pipe_quiesce(pipe);
+		fifo_set_minsize(&pipe->fifo, pipe->new_minsize);
+		pipe->new_minsize = 0;
+	}
+}
+
+
+/** Closes the read side if the read found the EOF.  cnt is what
+ *  fifo_read (or fifo_read_done) returned.
+ */
+
+static int pipe_read_result(struct pipe *pipe, int cnt)
 {
-	int cnt = fifo_read(&pipe->fifo, pipe->read_atom->atom.fd);
 	if(cnt == -2) {
 		// File was EOFd.  Close automatically.
 		// We won't close here because we're waiting for a sigchld
@@ -58,12 +390,110 @@ static int pipe_fifo_read(struct pipe *pipe)
 }
 
 
-/** Calls fifo_write and handles the case if it returns EPIPE.
+/** Calls fifo_read and handles the case if it returns an EOF.
  */
 
-static int pipe_fifo_write(struct pipe *pipe)
+static int pipe_fifo_read(struct pipe *pipe)
+{
+	int cnt;
+
+	pipe->in_proc += 1;
+	cnt = fifo_read(&pipe->fifo, pipe->read_atom->atom.fd);
+	pipe_proc_done(pipe);
+
+	return pipe_read_result(pipe, cnt);
+}
+
+
+/** Runs what pipe_park saved through the fifo as if it had just been
+ *  read.  Returns 0 if there isn't room for it yet.
+ */
+
+static int pipe_unpark(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->read_atom;
+	struct fifo *f = &pipe->fifo;
+	struct pipe_park_seg *seg;
+	struct iovec iov;
+	int cnt = 0;
+
+	while(fifo_avail(f) - f->hold < atom->parked_cnt) {
+		if(!fifo_inflate(f)) {
+			pipe_block_read(pipe);
+			return 0;
+		}
+	}
+
+	pipe->in_proc += 1;
+	for(seg = atom->parked; seg; seg = seg->next) {
+		iov.iov_base = seg->data;
+		iov.iov_len = seg->len;
+		cnt = fifo_read_done(f, atom->atom.fd, &iov, 1, seg->len);
+	}
+	pipe_proc_done(pipe);
+
+	pipe_park_free(atom);
+	pipe_read_result(pipe, cnt);
+	return 1;
+}
+
+
+/** Called when the fifo has drained up to its mark (see fifo_mark).
+ *  The mark proc usually installs a new task, so the pipe probably
+ *  has a different writer by the time it returns.  The old writer
+ *  has nothing more to say.
+ */
+
+static void pipe_reached_mark(struct pipe *pipe)
+{
+	struct fifo *f = &pipe->fifo;
+	fifo_mark_proc proc = f->mark_proc;
+
+	if(pipe_toggles(pipe->io) && pipe->write_atom->atom.fd >= 0) {
+		io_disable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
+	}
+
+	// the proc may take data back out of the fifo
+	pipe_quiesce(pipe);
+
+	f->mark_proc = NULL;
+	pipe->in_proc += 1;
+	(*proc)(f, f->mark_refcon);
+	pipe_proc_done(pipe);
+
+	// anything after the mark goes to the new writer
+	if(fifo_count(f) && pipe->write_atom->atom.fd >= 0) {
+		if(io_edge_triggered(pipe->io)) {
+			io_pend(pipe->io, &pipe->write_atom->atom, IO_WRITE);
+		} else if(pipe_toggles(pipe->io)) {
+			io_enable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
+		}
+	}
+	pipe_resume(pipe);
+}
+
+
+/** Shrinks the fifo if it has drained far enough (see fifo_deflate).
+ *  The fifo moves if it does, so the reader hands its buffers back.
+ */
+
+static void pipe_deflate(struct pipe *pipe)
+{
+	struct fifo *f = &pipe->fifo;
+
+	if(f->size != f->minsize && fifo_count(f) <= f->lowat) {
+		pipe_quiesce_read(pipe);
+		fifo_deflate(f);
+	}
+}
+
+
+/** Handles what fifo_write (or fifo_write_done) returned: closes the
+ *  write side on EPIPE and calls the mark proc once it's reached.
+ */
+
+static void pipe_wrote(struct pipe *pipe, int cnt)
 {
-	int cnt = fifo_write(&pipe->fifo, pipe->write_atom->atom.fd);
 	if(cnt == -1 && errno == EPIPE) {
 		log_info("Closed FD %d due to EPIPE", pipe->write_atom->atom.fd);
 		close(pipe->write_atom->atom.fd);
@@ -74,62 +504,131 @@ static int pipe_fifo_write(struct pipe *pipe)
 
 	if(cnt > 0) {
 		pipe->bytes_written += cnt;
+		pipe_deflate(pipe);
+	}
+
+	// A short write means the fd filled up.  It'll signal when
+	// it drains.
+	if(fifo_count(&pipe->fifo)) {
+		pipe->write_atom->ready &= ~IO_WRITE;
+	}
+
+	if(pipe->fifo.mark_proc && pipe->fifo.beg == pipe->fifo.mark) {
+		pipe_reached_mark(pipe);
 	}
+}
+
 
+/** Calls fifo_write and handles the case if it returns EPIPE.
+ */
+
+static int pipe_fifo_write(struct pipe *pipe)
+{
+	int cnt = fifo_write(&pipe->fifo, pipe->write_atom->atom.fd);
+	pipe_wrote(pipe, cnt);
 	return cnt;
 }
 
 
+/** Tells if it's worth trying to write to the pipe's output.
+ *  Level-triggered, we only get here when it is.
+ */
+
+static int pipe_can_write(struct pipe *pipe)
+{
+	return !io_edge_triggered(pipe->io) || (pipe->write_atom->ready & IO_WRITE);
+}
+
+
 /** Reads from the input side of the pipe, through the fifo
  * proc, into the fifo.  Immediately writes as much as possible,
- * scheduling any remainer for later.
+ * scheduling any remainer for later.  Keeps going until the input
+ * runs dry, the output stalls, or we've used up our budget for this
+ * wakeup (the rest waits for the next time through the event loop).
  */
 
 static void pipe_auto_read(struct pipe *pipe)
 {
 	int cnt, n;
+	int reads = 0, bytes = 0;
 
-#ifndef NDEBUG
-	if(!fifo_avail(&pipe->fifo)) {
-		assert(fifo_avail(&pipe->fifo) > 0);
-	}
-#endif
+	for(;;) {
+		if(!fifo_avail(&pipe->fifo) && !fifo_inflate(&pipe->fifo)) {
+			// Something besides a read filled the fifo (pipe_writev,
+			// or the last task's reader before a task switch).  Wait
+			// for the writer to make room like any other full fifo.
+			log_dbg("fifo is full! Not reading %d", pipe->read_atom->atom.fd);
+			pipe_block_read(pipe);
+			return;
+		}
 
-	cnt = pipe_fifo_read(pipe);
-	if(cnt == -1) {
-		log_warn("Error reading %d for pipe: %d (%s)",
-				pipe->read_atom->atom.fd, errno, strerror(errno));
-	}
+		cnt = pipe_fifo_read(pipe);
+		if(cnt == -1 && errno != EAGAIN) {
+			log_warn("Error reading %d for pipe: %d (%s)",
+					pipe->read_atom->atom.fd, errno, strerror(errno));
+		}
+		if(cnt == -1 && errno == EAGAIN) {
+			pipe->read_atom->ready &= ~IO_READ;
+		}
 
-	// perhaps the fifo proc sucked up all the data.
-	// Because we're using read/write events, we should never get a
-	// 0-byte read or write (well, the 0-byte read indicates EOF).
-	if(!fifo_count(&pipe->fifo)) {
-		return;
-	}
+		// perhaps the fifo proc sucked up all the data.
+		// Because we're using read/write events, we should never get a
+		// 0-byte read or write (well, the 0-byte read indicates EOF).
+		if(fifo_count(&pipe->fifo)) {
+			// immediately try to write the fifo out
+			if(pipe_can_write(pipe)) {
+				pipe_fifo_write(pipe);
+			}
 
-	// immediately try to write the fifo out
-	pipe_fifo_write(pipe);
+			n = fifo_count(&pipe->fifo);
+			if(n) {
+				break;
+			}
+		}
 
-	// return if we're all done (should be the normal case)
-	n = fifo_count(&pipe->fifo);
-	if(!n) {
-		return;
+		// EAGAIN, EOF, or error: the input is done for now.
+		if(cnt < 0) {
+			return;
+		}
+
+		reads += 1;
+		bytes += cnt;
+		if(reads >= pipe_read_budget || bytes >= pipe_byte_budget) {
+			log_dbg("read budget used up on %d after %d reads, %d bytes",
+					pipe->read_atom->atom.fd, reads, bytes);
+			if(io_edge_triggered(pipe->io)) {
+				// there won't be another edge until we drain it
+				io_pend(pipe->io, &pipe->read_atom->atom, IO_READ);
+			}
+			return;
+		}
 	}
 
 	// There's still data in the fifo so the last write didn't
 	// complete.  We need to be notified when we can write again.
-	io_enable(&pipe->write_atom->atom, IO_WRITE);
-	log_dbg("%d bytes remaining, enabling IO_WRITE on %d",
-			n, pipe->write_atom->atom.fd);
+	// (edge-triggered, the fd will tell us when it drains)
+	if(pipe_toggles(pipe->io)) {
+		io_enable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
+		log_dbg("%d bytes remaining, enabling IO_WRITE on %d",
+				n, pipe->write_atom->atom.fd);
+	}
 
-	// if there's no more room in the fifo then we need to stop trying
+	// if there's no more room in the fifo then try to make some.
+	// If it's already as big as it gets, we need to stop trying
 	// to read.  We'll restart reading when we manage to write some bytes.
-	if(!fifo_avail(&pipe->fifo)) {
+	if(!fifo_avail(&pipe->fifo) && !fifo_inflate(&pipe->fifo)) {
 		log_dbg("fifo is full! Disabling IO_READ on %d",
 				pipe->read_atom->atom.fd);
-		io_disable(&pipe->read_atom->atom, IO_READ);
-		pipe->block_read = 1;
+		pipe_block_read(pipe);
+	}
+
+	// Edge-triggered, the input won't signal again until we've read it
+	// to EAGAIN.  If we stopped short with room to spare (a short write
+	// or an output that isn't ready), get back to it ourselves.
+	if(io_edge_triggered(pipe->io) && !pipe->block_read &&
+			pipe->read_atom->atom.fd >= 0 &&
+			(pipe->read_atom->ready & IO_READ)) {
+		io_pend(pipe->io, &pipe->read_atom->atom, IO_READ);
 	}
 }
 
@@ -153,81 +652,193 @@ static void pipe_auto_write(struct pipe *pipe)
 	// If there's STILL no room in this fifo, it means the operating
 	// system lied to us when it sent us this write notification.
 	// If this assert is giving you trouble, just comment it out.
-	// It indicates an OS bug, not an rzh bug.
-	assert(fifo_avail(&pipe->fifo) > 0);
+	// It indicates an OS bug, not an rzh bug.  (Edge-triggered, the
+	// notification may be stale so it doesn't apply.)
+	assert(!pipe_toggles(pipe->io) || fifo_avail(&pipe->fifo) > 0);
 
 	// We just freed up some room.  If reads are currently
 	// blocking, we need to unblock them.
 	if(pipe->block_read && pipe->read_atom->atom.fd >= 0) {
-		io_enable(&pipe->read_atom->atom, IO_READ);
-		log_dbg("Freed some room so re-enabling IO_READ on %d",
-				pipe->read_atom->atom.fd);
-		pipe->block_read = 0;
+		if(pipe_toggles(pipe->io)) {
+			io_enable(pipe->io, &pipe->read_atom->atom, IO_READ);
+			log_dbg("Freed some room so re-enabling IO_READ on %d",
+					pipe->read_atom->atom.fd);
+		}
+		pipe_unblock_read(pipe);
+
+		// The reader stalled with data waiting, so there's almost
+		// certainly more.  Don't wait for another trip through the
+		// event loop to go get it.
+		if(!fifo_count(&pipe->fifo)) {
+			pipe_auto_read(pipe);
+		} else if(io_edge_triggered(pipe->io)) {
+			// the fd won't signal again until we've drained it
+			io_pend(pipe->io, &pipe->read_atom->atom, IO_READ);
+		}
 	}
 
 	// if there's no more data left in the fifo,
 	// turn off write notification
-	if(!fifo_count(&pipe->fifo)) {
-		io_disable(&pipe->write_atom->atom, IO_WRITE);
+	if(!fifo_count(&pipe->fifo) && pipe_toggles(pipe->io)) {
+		io_disable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
 		log_dbg("Fifo is empty, disabliing IO_WRITE on %d",
 				pipe->write_atom->atom.fd);
 	}
 }
 
 
+/** A read that the backend did for the pipe has finished.
+ */
+
+static void pipe_read_done(pipe_atom *atom)
+{
+	struct pipe *pipe = atom->read_pipe;
+	int res = atom->rx.result;
+	int cnt = res;
+
+	assert(pipe->read_atom == atom);
+
+	if(res < 0) {
+		errno = -res;
+		cnt = -1;
+	}
+
+	pipe->in_proc += 1;
+	cnt = fifo_read_done(&pipe->fifo, atom->atom.fd, atom->rx.iov, atom->rx.iovcnt, cnt);
+	pipe_proc_done(pipe);
+
+	if(res < 0 && res != -EAGAIN) {
+		log_warn("Error reading %d for pipe: %d (%s)",
+				atom->atom.fd, -res, strerror(-res));
+	}
+
+	pipe_read_result(pipe, cnt);
+	pipe_resume(pipe);
+}
+
+
+/** A write that the backend did for the pipe has finished.
+ */
+
+static void pipe_write_done(pipe_atom *atom)
+{
+	struct pipe *pipe = atom->write_pipe;
+	int res = atom->tx.result;
+	int cnt = res;
+
+	assert(pipe->write_atom == atom);
+
+	if(res < 0) {
+		errno = -res;
+		cnt = -1;
+	}
+	fifo_write_done(&pipe->fifo, atom->atom.fd, atom->tx.iov, cnt);
+	if(res < 0) {
+		errno = -res;
+	}
+	pipe_wrote(pipe, cnt);
+
+	// We just freed up some room, so the reader can go again.
+	if(cnt > 0 && pipe->block_read) {
+		pipe_unblock_read(pipe);
+	}
+
+	pipe_resume(pipe);
+}
+
+
 /** Tries to write to the atom immediately.  Anything that the
  *  atom didn't consume will be stored by the pipe for later.
  *  This is intended to fill pipes programmatically rather than
- *  from a file handle.
+ *  from a file handle.  The data is gathered from the iovec so
+ *  callers holding it in pieces needn't copy it together first.
  *
- *  @returns The number of bytes written.  This will always equal size
- *  unless the receiving filehandle is blocking AND the fifo is full.
- *  (this should never happen)
+ *  @returns The number of bytes written.  This will always equal the
+ *  total size unless the receiving filehandle is blocking AND the fifo
+ *  is full and can't grow any more.  (this should never happen)
  */
 
-int pipe_write(struct pipe *pipe, const char *buf, int size)
+int pipe_writev(struct pipe *pipe, const struct iovec *iov, int iovcnt)
 {
-	int cnt;
+	int i, cnt = 0;
 	int total = 0;
 
+	// an inflate would move the fifo out from under the kernel
+	pipe_quiesce(pipe);
+
 	if(!fifo_count(&pipe->fifo)) {
 		// Nothing in the pipe.  We can try an immediate write.
 		do {
 			errno = 0;
-			cnt = write(pipe->write_atom->atom.fd, buf, size);
+			cnt = writev(pipe->write_atom->atom.fd, iov, iovcnt);
+			pipe->stats.direct_writes += 1;
 		} while(cnt == -1 && errno == EINTR);
 		if(cnt < 0) {
 			log_warn("pipe write: cnt=%d error=%d (%s)", cnt, errno, strerror(errno));
+			cnt = 0;
 		} else {
-			log_dbg("pipe_write %d bytes to %d: %s", cnt, pipe->write_atom->atom.fd, sanitize(buf, cnt));
-			buf += cnt;
+			log_dbg("pipe_write %d bytes to %d", cnt, pipe->write_atom->atom.fd);
+			pipe->stats.direct_bytes += cnt;
 			total += cnt;
-			size -= cnt;
 		}
 	}
 
-	if(size <= 0) {
+	// Store whatever didn't get written in the fifo.
+	for(i=0; i<iovcnt; i++) {
+		const char *buf = iov[i].iov_base;
+		int size = iov[i].iov_len;
+
+		if(cnt >= size) {
+			// this piece was written entirely
+			cnt -= size;
+			continue;
+		}
+		buf += cnt;
+		size -= cnt;
+		cnt = 0;
+
+		while(fifo_avail(&pipe->fifo) < size && fifo_inflate(&pipe->fifo)) {
+			// keep growing
+		}
+		if(size > fifo_avail(&pipe->fifo)) {
+			size = fifo_avail(&pipe->fifo);
+		}
+		fifo_unsafe_append(&pipe->fifo, buf, size);
+		total += size;
+	}
+
+	if(io_can_transfer(pipe->io)) {
+		pipe_resume(pipe);
+	} else if(io_edge_triggered(pipe->io)) {
+		// interest never changes.  pipe_fifo_write's caller will
+		// hear about it when the fd drains.
+		if(fifo_count(&pipe->fifo)) {
+			pipe->write_atom->ready &= ~IO_WRITE;
+		}
+	} else if(!fifo_count(&pipe->fifo)) {
 		// no need to watch for write events on this file
-		io_disable(&pipe->write_atom->atom, IO_WRITE);
+		io_disable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
 		log_dbg("Wrote entire fifo, disabling IO_WRITE on %d",
 				pipe->write_atom->atom.fd);
-		return total;
+	} else {
+		// Need to be notified when we can write again
+		io_enable(pipe->io, &pipe->write_atom->atom, IO_WRITE);
+		log_dbg("Fifo still has data, enabling IO_WRITE on %d",
+				pipe->write_atom->atom.fd);
 	}
 
-	// There was unwritten data.  Try to write it to the fifo.
-	cnt = fifo_avail(&pipe->fifo);
-	if(size < cnt) cnt = size;
-	fifo_unsafe_append(&pipe->fifo, buf, cnt);
-	buf += cnt;
-	total += cnt;
-	size -= cnt;
+	return total;
+}
 
-	// Need to be notified when we can write again
-	io_enable(&pipe->write_atom->atom, IO_WRITE);
-	log_dbg("Fifo still has data, enabling IO_WRITE on %d",
-			pipe->write_atom->atom.fd);
 
-	return total;
+int pipe_write(struct pipe *pipe, const char *buf, int size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (char*)buf;
+	iov.iov_len = size;
+
+	return pipe_writev(pipe, &iov, 1);
 }
 
 
@@ -237,6 +848,61 @@ int pipe_write(struct pipe *pipe, const char *buf, int size)
 void pipe_io_proc(io_atom *aa, int flags)
 {
 	pipe_atom *atom = (pipe_atom*)aa;
+	struct pipe *pipe;
+
+	if(io_can_transfer(atom->io)) {
+		if(flags & IO_DONE) {
+			if(flags & IO_READ) {
+				pipe_read_done(atom);
+			}
+			if(flags & IO_WRITE) {
+				pipe_write_done(atom);
+			}
+			return;
+		}
+
+		// Not a completion: somebody wants the i/o done right now
+		// (a task switch, a cancelled transfer, the sigchild handler
+		// draining a child).  Do it with syscalls, then go back to
+		// queueing transfers.
+		if((flags & IO_READ) && atom->read_pipe &&
+				atom->read_pipe->read_atom == atom) {
+			pipe = atom->read_pipe;
+			pipe_quiesce(pipe);
+			if(!atom->parked || pipe_unpark(pipe)) {
+				if(atom->atom.fd >= 0 && !pipe->block_read) {
+					pipe_auto_read(pipe);
+				}
+			}
+			pipe_resume(pipe);
+		}
+		if((flags & IO_WRITE) && atom->write_pipe &&
+				atom->write_pipe->write_atom == atom) {
+			pipe = atom->write_pipe;
+			pipe_quiesce(pipe);
+			pipe_auto_write(pipe);
+			pipe_resume(pipe);
+		}
+		return;
+	}
+
+	if(io_edge_triggered(atom->io)) {
+		// We hear about every atom all the time, even ones that
+		// aren't currently attached to the pipe (a task that's been
+		// covered by another) or that only use one direction.  Just
+		// note the readiness; it's acted on when the atom is attached.
+		atom->ready |= flags & (IO_READ | IO_WRITE);
+		if((flags & IO_READ) && atom->read_pipe &&
+				atom->read_pipe->read_atom == atom &&
+				!atom->read_pipe->block_read) {
+			pipe_auto_read(atom->read_pipe);
+		}
+		if((flags & IO_WRITE) && atom->write_pipe &&
+				atom->write_pipe->write_atom == atom) {
+			pipe_auto_write(atom->write_pipe);
+		}
+		return;
+	}
 
 	if(flags & IO_READ) {
 		pipe_auto_read(atom->read_pipe);
@@ -252,14 +918,19 @@ void pipe_io_proc(io_atom *aa, int flags)
  *  struct pipes.
  */
 
-void pipe_atom_init(pipe_atom *atom, int fd)
+void pipe_atom_init(io_ctx *io, pipe_atom *atom, int fd)
 {
 	int err;
 
 	log_dbg("created pipe atom 0x%08lX for %d", atom, fd);
 	set_nonblock(fd);
 	io_atom_init(&atom->atom, fd, pipe_io_proc);
-	err = io_add(&atom->atom, 0);
+	atom->io = io;
+	atom->ready = 0;
+	atom->rx.busy = 0;
+	atom->tx.busy = 0;
+	atom->parked = NULL;
+	err = io_add(io, &atom->atom, io_edge_triggered(io) ? IO_READ | IO_WRITE | IO_EDGE : 0);
 	if(err != 0) {
 		fprintf(stderr, "%d (%s) setting up pipe atom for fd %d",
 				err, strerror(-err), fd);
@@ -275,7 +946,11 @@ void pipe_atom_destroy(pipe_atom *atom)
 {
 	log_dbg("destroyed pipe atom 0x%08lX for %d", atom, atom->atom.fd);
 	if(atom->atom.fd >= 0) {
-		io_del(&atom->atom);
+		// the kernel has to give back the buffers before they go away
+		io_cancel(atom->io, &atom->rx);
+		io_cancel(atom->io, &atom->tx);
+		io_del(atom->io, &atom->atom);
+		pipe_park_free(atom);
 	}
 }
 
@@ -285,33 +960,79 @@ void pipe_atom_destroy(pipe_atom *atom)
  *  rather than from another pipe.
  */
 
-void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size)
+void pipe_init(io_ctx *io, struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size, int maxsize)
 {
-	fifo_init(&pipe->fifo, size);
+	fifo_init(&pipe->fifo, size, maxsize);
 	if(pipe->fifo.buf == NULL) {
 		perror("could not allocate fifo");
 		bail(99);
 	}
 
+	pipe->io = io;
 	pipe->read_atom = ratom;
 	if(ratom) ratom->read_pipe = pipe;
 	pipe->write_atom = watom;
 	if(watom) watom->write_pipe = pipe;
 
 	pipe->block_read = 0;
+	pipe->in_proc = 0;
+	pipe->new_minsize = 0;
 	pipe->bytes_written = 0;
+	memset(&pipe->stats, 0, sizeof(pipe->stats));
 
 	// all pipes start out listening for readable events
 	// unless there's no atom on the read side (i.e. the progress pipe
 	// which is filled by a function, not by a reader).
-	if(pipe->read_atom) {
-		io_enable(&pipe->read_atom->atom, IO_READ);
+	if(pipe->read_atom && io_can_transfer(pipe->io)) {
+		pipe_resume(pipe);
+	} else if(pipe->read_atom && !io_edge_triggered(pipe->io)) {
+		io_enable(pipe->io, &pipe->read_atom->atom, IO_READ);
 		log_dbg("Fifo is brand new, enabling IO_READ on %d",
 				pipe->read_atom->atom.fd);
 	}
 }
 
 
+static int atom_fd(pipe_atom *atom)
+{
+	return atom ? atom->atom.fd : -1;
+}
+
+
+/** Prints the pipe's state and counters to stderr.  Used by the SIGUSR1
+ *  snapshot so it needs to be safe to call at any time from the
+ *  event loop.  The terminal is in raw mode so lines end in \r\n.
+ */
+
+void pipe_dump(struct pipe *pipe, const char *name)
+{
+	struct fifo *f = &pipe->fifo;
+	double blocked = pipe->stats.blocked_time;
+
+	if(pipe->block_read) {
+		blocked += pipe_now() - pipe->stats.blocked_since;
+	}
+
+	fprintf(stderr, "  %s: fd %d -> fd %d%s%s%s\r\n", name,
+			atom_fd(pipe->read_atom), atom_fd(pipe->write_atom),
+			pipe->block_read ? " (reads blocked)" : "",
+			atom_fd(pipe->read_atom) >= 0 && pipe->read_atom->rx.busy ? " (read queued)" : "",
+			atom_fd(pipe->write_atom) >= 0 && pipe->write_atom->tx.busy ? " (write queued)" : "");
+	fprintf(stderr, "    fifo %d/%d bytes (min %d, max %d, peak %d)\r\n",
+			fifo_count(f), f->size, f->minsize, f->maxsize, f->stats.peak);
+	fprintf(stderr, "    read %llu bytes in %lu reads, wrote %llu bytes in %lu writes\r\n",
+			(unsigned long long)f->stats.bytes_in, f->stats.reads,
+			(unsigned long long)f->stats.bytes_out, f->stats.writes);
+	if(pipe->stats.direct_writes) {
+		fprintf(stderr, "    pipe_write wrote %llu bytes in %lu writes\r\n",
+				(unsigned long long)pipe->stats.direct_bytes,
+				pipe->stats.direct_writes);
+	}
+	fprintf(stderr, "    %lu EAGAIN, %lu EINTR, %lu stalls, %.3fs blocked\r\n",
+			f->stats.eagain, f->stats.eintr, pipe->stats.stalls, blocked);
+}
+
+
 /** The atoms are destroyed with the tasks, not the pipe. */
 
 void pipe_destroy(struct pipe *pipe)
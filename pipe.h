@@ -1,4 +1,6 @@
 struct pipe;
+struct iovec;
+struct pipe_park_seg;
 
 /** A pipe atom is used to either fill or drain a pipe fifo.
  *  A single atom may be used for reading one fifo and simultaneously
@@ -7,31 +9,63 @@ struct pipe;
 
 typedef struct {
 	io_atom atom;				// represents a file or socket
+	io_ctx *io;					// the event loop that watches the atom
 	struct pipe *read_pipe;		// the pipe that this atom reads its data into	(this field has also been usurped to be the read verso refcon)
 	struct pipe *write_pipe;	// the pipe that this atom gets its data from
+	int ready;					// IO_READ/IO_WRITE the fd has signalled and we haven't used up (edge-triggered only)
+	io_xfer rx, tx;				// the read and write the io backend is doing for us (see io_transfer)
+	struct pipe_park_seg *parked;	// data a cancelled read brought in, waiting to go through the fifo (see pipe_quiesce)
+	int parked_cnt;				// how much is parked (0 for an EOF)
 } pipe_atom;
 
 
+/** Counters kept by the pipe on top of the ones its fifo keeps
+ *  (see struct fifo_stats).  Dumped by pipe_dump.
+ */
+
+struct pipe_stats {
+	uint64_t direct_bytes;			// bytes written by pipe_write, bypassing the fifo
+	unsigned long direct_writes;	// write syscalls made by pipe_write
+	unsigned long stalls;			// times the fifo filled up and reading was blocked
+	double blocked_since;			// when reading was last blocked
+	double blocked_time;			// total seconds spent with reading blocked
+};
+
+
 struct pipe {
 	struct fifo fifo;			// the fifo itself
+	io_ctx *io;					// the event loop that both atoms belong to
 	pipe_atom *read_atom;		// all data read from here ...
 	pipe_atom *write_atom;		// ... gets written to here
 	int block_read;				// 1 if we need to stop reading, 0 if not.
-	int bytes_written;			// a monotonically increasing count of the number of bytes written.
+	int in_proc;				// nonzero while a fifo proc or mark proc is running: no transfers may start and the fifo may not move
+	int new_minsize;			// fifo minsize to apply once in_proc drops to 0 (0 for none)
+	uint64_t bytes_written;		// a monotonically increasing count of the number of bytes written.
+	struct pipe_stats stats;
 };
 
 
+extern int pipe_read_budget;
+extern int pipe_byte_budget;
+
 int pipe_prepend(struct pipe *pipe, const char *buf, int size);
 int pipe_write(struct pipe *pipe, const char *buf, int size);
+int pipe_writev(struct pipe *pipe, const struct iovec *iov, int iovcnt);
 
-void pipe_atom_init(pipe_atom *atom, int fd);
+void pipe_atom_init(io_ctx *io, pipe_atom *atom, int fd);
 void pipe_atom_destroy(pipe_atom *atom);
 
-void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size);
+void pipe_init(io_ctx *io, struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size, int maxsize);
 void pipe_destroy(struct pipe *pipe);
 
 void pipe_io_proc(io_atom *aa, int flags);
 
+void pipe_unblock_read(struct pipe *pipe);
+void pipe_quiesce(struct pipe *pipe);
+void pipe_resume(struct pipe *pipe);
+int pipe_set_minsize(struct pipe *pipe, int size);
+void pipe_dump(struct pipe *pipe, const char *name);
+
 
 // utility function
 int set_nonblock(int fd);
@@ -0,0 +1,125 @@
+/* pool.c
+ * Scott Bronson
+ *
+ * A tiny slab allocator.  See pool.h.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+
+#define POOL_SLAB_SIZE 4096		// bytes per slab (unless objects are huge)
+#define POOL_SLAB_MIN 4			// fewest objects per slab
+#define POOL_ALIGN 16
+
+
+static __thread struct pool *pool_list;	// every pool this thread has allocated a slab for
+
+
+/** Adds a slab to the pool and threads its objects onto the free list.
+ *  The first word of each slab links it to the next slab.
+ */
+
+static int pool_grow(struct pool *pool)
+{
+	int i, cnt;
+	char *slab, *obj;
+
+	if(!pool->stats.slabs) {
+		// first slab: round the object up so that it can hold the
+		// free list pointer and stays aligned.
+		if(pool->objsize < (int)sizeof(void*)) {
+			pool->objsize = sizeof(void*);
+		}
+		pool->objsize = (pool->objsize + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+		pool->next = pool_list;
+		pool_list = pool;
+	}
+
+	cnt = (POOL_SLAB_SIZE - POOL_ALIGN) / pool->objsize;
+	if(cnt < POOL_SLAB_MIN) {
+		cnt = POOL_SLAB_MIN;
+	}
+
+	slab = malloc(POOL_ALIGN + cnt * pool->objsize);
+	if(slab == NULL) {
+		return 0;
+	}
+
+	*(void**)slab = pool->slabs;
+	pool->slabs = slab;
+	pool->stats.slabs += 1;
+
+	obj = slab + POOL_ALIGN;
+	for(i=0; i<cnt; i++) {
+		*(void**)obj = pool->free;
+		pool->free = obj;
+		obj += pool->objsize;
+	}
+
+	return 1;
+}
+
+
+/** Returns a zeroed object from the pool, or NULL if the heap is
+ *  out of memory.
+ */
+
+void* pool_alloc(struct pool *pool)
+{
+	void *obj;
+
+	if(!pool->free && !pool_grow(pool)) {
+		return NULL;
+	}
+
+	obj = pool->free;
+	pool->free = *(void**)obj;
+	memset(obj, 0, pool->objsize);
+
+	pool->stats.allocs += 1;
+	pool->stats.inuse += 1;
+	if(pool->stats.inuse > pool->stats.peak) {
+		pool->stats.peak = pool->stats.inuse;
+	}
+
+	return obj;
+}
+
+
+/** Returns an object to its pool.  Like free(), NULL is ignored. */
+
+void pool_free(struct pool *pool, void *obj)
+{
+	if(obj == NULL) {
+		return;
+	}
+
+	*(void**)obj = pool->free;
+	pool->free = obj;
+
+	pool->stats.frees += 1;
+	pool->stats.inuse -= 1;
+}
+
+
+/** Prints the counters for every pool to stderr (raw terminal). */
+
+void pool_dump()
+{
+	struct pool *pool;
+
+	for(pool = pool_list; pool; pool = pool->next) {
+		fprintf(stderr, "  pool %s: %d bytes, %d in use (peak %d), "
+				"%lu allocs, %lu frees, %lu slabs\r\n",
+				pool->name, pool->objsize, pool->stats.inuse,
+				pool->stats.peak, pool->stats.allocs, pool->stats.frees,
+				pool->stats.slabs);
+	}
+}
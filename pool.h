@@ -0,0 +1,49 @@
+/* pool.h
+ * Scott Bronson
+ *
+ * A tiny slab allocator for the fixed-size structures that get
+ * created and destroyed for every transfer.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+/** Each pool hands out objects of a single size.  Objects are carved
+ *  out of slabs that are never returned to the heap; freed objects go
+ *  onto the pool's free list to be handed out again.  So, once a pool
+ *  has grown to its high-water mark, back-to-back transfers never touch
+ *  malloc.
+ *
+ *  Declare pools statically with POOL_INIT.  No further setup is needed.
+ *
+ *  Pools are per thread: declare them __thread so each event loop's
+ *  thread gets its own free lists and slabs and nothing needs locking.
+ *  An object must be freed by the thread that allocated it (which is
+ *  the thread running the io_ctx it belongs to).  pool_dump prints the
+ *  calling thread's pools.
+ */
+
+struct pool_stats {
+	unsigned long allocs;	// objects handed out
+	unsigned long frees;	// objects returned
+	unsigned long slabs;	// slabs malloced
+	int inuse;				// objects currently handed out
+	int peak;				// most objects ever handed out at once
+};
+
+
+struct pool {
+	const char *name;
+	int objsize;			// size of each object (rounded up when the first slab is created)
+	void *free;				// the free list (threaded through the objects)
+	void *slabs;			// every slab we've allocated
+	struct pool *next;		// all pools that have been used, for pool_dump
+	struct pool_stats stats;
+};
+
+#define POOL_INIT(nm, type) { .name = (nm), .objsize = sizeof(type) }
+
+
+void* pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+void pool_dump();
@@ -20,6 +20,7 @@
 #include <setjmp.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
 
 #include "log.h"
@@ -29,6 +30,8 @@
 #include "task.h"
 #include "cmd.h"
 #include "echotask.h"
+#include "rztask.h"
+#include "zmark.h"
 #include "consoletask.h"
 #include "util.h"
 
@@ -41,6 +44,7 @@ const char *download_dir = NULL;	// download files to this directory
 static jmp_buf g_bail;
 socket_addr conn_addr;
 int conn_fd = -1;
+static io_ctx *io;	// the event loop
 
 
 #if !defined(PATH_MAX)
@@ -78,7 +82,7 @@ void rzh_fork_prepare()
 		close(conn_fd);
 	}
 
-	io_exit();
+	io_exit(io);
 	log_close();
 	fdcheck();
 }
@@ -234,6 +238,12 @@ static void usage()
 			"  -i --info    : tells if rzh is currently running or not.\n"
 			"  -V --version : print the version of this program.\n"
 			"  -h --help    : prints this help text\n"
+			"  --pipe-size=BYTES : size of the pipes to rz (0 = system default)\n"
+			"  --fifo-max=BYTES  : largest a buffer may grow during a transfer\n"
+			"  --manifest=FILE   : list received files' SHA-256 here (rzh.sha256)\n"
+			"  --no-manifest     : don't write the manifest\n"
+			"  --io-backend=NAME : event loop to use (select, poll, epoll, uring)\n"
+			"  --io-level   : don't use edge-triggered events even if available\n"
 			"Run rzh with no arguments to receive files into the current directory.\n"
 		  );
 }
@@ -254,6 +264,17 @@ static void process_args(int argc, char **argv)
 		CONNECT_ADDR,
 		INMA_FIFO_SIZE,
 		MAOU_FIFO_SIZE,
+		MAX_FIFO_SIZE,
+		FIFO_EXACT,
+		FIFO_NOMIRROR,
+		ZMARK_SCALAR,
+		READ_BUDGET,
+		BYTE_BUDGET,
+		PIPE_SIZE,
+		MANIFEST,
+		NO_MANIFEST,
+		IO_BACKEND,
+		IO_LEVEL,
 	};
 
 	while(1) {
@@ -267,12 +288,23 @@ static void process_args(int argc, char **argv)
 			{"version", 0, 0, 'V'},
 
 			{"rz", 1, 0, RZ_CMD},		// unfinished
+			{"pipe-size", 1, 0, PIPE_SIZE},
+			{"manifest", 1, 0, MANIFEST},
+			{"no-manifest", 0, 0, NO_MANIFEST},
+			{"io-backend", 1, 0, IO_BACKEND},
+			{"io-level", 0, 0, IO_LEVEL},
+			{"fifo-max", 1, 0, MAX_FIFO_SIZE},
 
 #ifndef NDEBUG
 			{"connect", 1, 0, CONNECT_ADDR},
 			{"debug-attach", 0, 0, 'D'},
 			{"fifo-inma", 1, 0, INMA_FIFO_SIZE},
 			{"fifo-maout", 1, 0, MAOU_FIFO_SIZE},
+			{"fifo-exact", 0, 0, FIFO_EXACT},
+			{"fifo-nomirror", 0, 0, FIFO_NOMIRROR},
+			{"zmark-scalar", 0, 0, ZMARK_SCALAR},
+			{"read-budget", 1, 0, READ_BUDGET},
+			{"byte-budget", 1, 0, BYTE_BUDGET},
 			{"loglevel", 1, 0, LOG_LEVEL},
 			{"log-level", 1, 0, LOG_LEVEL},
 			{"logfile", 1, 0, LOG_FILE},
@@ -310,10 +342,27 @@ static void process_args(int argc, char **argv)
 				log_init(optarg);
 				break;
 
+			case FIFO_EXACT:
+				// don't round fifo sizes up to a power of two
+				fifo_pow2 = 0;
+				break;
+
+			case FIFO_NOMIRROR:
+				// use plain heap buffers for the fifos
+				fifo_mirror = 0;
+				break;
+
+			case ZMARK_SCALAR:
+				// don't use the SSE2/AVX2 skip kernels
+				zmark_simd = 0;
+				break;
+
 			// options taking integer arguments
 			case LOG_LEVEL:
 			case INMA_FIFO_SIZE:
 			case MAOU_FIFO_SIZE:
+			case READ_BUDGET:
+			case BYTE_BUDGET:
 				if(!io_safe_atoi(optarg, &i)) {
 					fprintf(stderr, "Invalid number: \"%s\"\n", optarg);
 					exit(argument_error);
@@ -341,6 +390,19 @@ static void process_args(int argc, char **argv)
 						}
 						break;
 
+					case READ_BUDGET:
+					case BYTE_BUDGET:
+						if(i < 1) {
+							fprintf(stderr, "Value out of range: %d\n", i);
+							exit(argument_error);
+						}
+						if(c == READ_BUDGET) {
+							pipe_read_budget = i;
+						} else {
+							pipe_byte_budget = i;
+						}
+						break;
+
 					default:
 						assert(!"No handler for option");
 
@@ -348,6 +410,49 @@ static void process_args(int argc, char **argv)
 				break;
 #endif
 
+			case PIPE_SIZE:
+			case MAX_FIFO_SIZE:
+				if(!io_safe_atoi(optarg, &i)) {
+					fprintf(stderr, "Invalid number: \"%s\"\n", optarg);
+					exit(argument_error);
+				}
+				if(i < 0 || i > 64*1024*1024) {
+					fprintf(stderr, "Value out of range: %d\n", i);
+					exit(argument_error);
+				}
+				if(c == PIPE_SIZE) {
+					rz_pipe_size = i;
+				} else {
+					fifo_max_size = i;
+				}
+				break;
+
+			case MANIFEST:
+				if(!optarg[0]) {
+					fprintf(stderr, "The manifest needs a name.\n");
+					exit(argument_error);
+				}
+				rz_manifest = optarg;
+				break;
+
+			case NO_MANIFEST:
+				rz_manifest = NULL;
+				break;
+
+			case IO_BACKEND:
+				if(!io_use(optarg)) {
+					char buf[128];
+					io_list_backends(buf, sizeof(buf));
+					fprintf(stderr, "Unknown io backend \"%s\".  Use %s.\n",
+							optarg, buf);
+					exit(argument_error);
+				}
+				break;
+
+			case IO_LEVEL:
+				io_use_level();
+				break;
+
 			case 'i':
 				get_info();
 				break;
@@ -402,17 +507,17 @@ int main(int argc, char **argv)
 
 	log_set_priority(0);
 
-	// We do not ensure that io_exit is called after forking but
-	// before execing.  For select this is OK.  If we move to a
-	// fd-based select scheme, though, it may be an issue.
-	io_init();
-
 	cmd_init(&rzcmd);
 	conn_addr.addr.s_addr = inet_addr("127.0.0.1");
 	conn_addr.port = 0;
 
 	process_args(argc, argv);
 
+	// After process_args because --io-backend picks the backend.
+	// Children call io_exit before execing (see rzh_fork_prepare
+	// and bgio's do_child) so fd-based schemes like epoll don't leak.
+	io = io_init();
+
 	if(rzcmd.path == NULL) {
 		// if user didn't specify the rzcmd to use, load default
 		cmd_parse(&rzcmd, DEFAULT_RZ_COMMAND);
@@ -432,19 +537,22 @@ int main(int argc, char **argv)
 	val = setjmp(g_bail);
 	if(val == 0) {
 		preflight();
-		mp = master_setup(conn_fd);
+		mp = master_setup(io, conn_fd);
 		log_dbg("Created master task at 0x%08lX", (long)mp);
 		task_install(mp, echo_scanner_create_spec(mp));
 		for(;;) {
 			// main loop, only ends through longjmp
-			int time = master_idle(mp);
-			log_dbg("loop...   timeout=%d", time);
-			io_wait(time);
-			io_dispatch();
+			// timers (like rz's progress display) wake io_wait
+			// when they're due so there's no timeout here.
+			master_idle(mp);
+			log_dbg("loop...");
+			io_wait(io, INT_MAX);
+			io_dispatch(io);
 			// Turns out we need to dispatch before handling sigchlds.
 			// Otherwise, since the sigchld probably causes fds to open
 			// and close, we end up dispatching on stale events.  Bad.
 			master_check_sigchild(mp);
+			master_check_dump(mp);
 		}
 	}
 	if(val == 1) {
@@ -459,7 +567,7 @@ int main(int argc, char **argv)
 		// We're not forking, we're qutting normally.  The requirements are
 		// exactly the same: verify everything has been shut down properly.
 		rzh_fork_prepare();
-		io_exit_check();
+		io_exit_check(io);
 	}
 
 	exit(val);
@@ -5,12 +5,18 @@
  * The task that handles the zmodem child.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// for F_SETPIPE_SZ
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "log.h"
 #include "fifo.h"
@@ -20,12 +26,17 @@
 #include "task.h"
 #include "rztask.h"
 #include "util.h"
+#include "zmark.h"
 #include "zrq.h"
+#include "sha256.h"
+#include "zdecode.h"
 #include "zfin.h"
 #include "idle.h"
 
 
 command rzcmd;	// specifies the rz executable we should run.
+int rz_pipe_size = 256*1024;	// how big to make the pipes to the rz child (0 leaves them alone)
+const char *rz_manifest = "rzh.sha256";	// where to list the received files' hashes (NULL for nowhere)
 
 
 static void parse_typing(const char *buf, int len, void *refcon)
@@ -61,24 +72,33 @@ static void typing_io_proc(io_atom *inatom, int flags)
 	char buf[128];
 	int cnt;
 
-	if(flags != IO_READ) {
+	// An edge-triggered atom is told when it's writable too.
+	if(flags != IO_READ && !io_edge_triggered(atom->io)) {
 		log_warn("Got flags=%d in parse_typing_proc!");
-		if(!(flags & IO_READ)) {
-			return;
-		}
+	}
+	if(!(flags & IO_READ)) {
+		return;
 	}
 
-	do {
-		errno = 0;
-		cnt = read(atom->atom.fd, buf, sizeof(buf));
-	} while(cnt == -1 && errno == EINTR);
+	// Read until there's nothing left so this works whether or not
+	// the atom is edge-triggered.
+	for(;;) {
+		do {
+			errno = 0;
+			cnt = read(atom->atom.fd, buf, sizeof(buf));
+		} while(cnt == -1 && errno == EINTR);
+
+		if(cnt > 0) {
+			parse_typing(buf, cnt, (void*)atom->read_pipe);
+			continue;
+		}
 
-	if(cnt > 0) {
-		parse_typing(buf, cnt, (void*)atom->read_pipe);
-	} else if(cnt == 0) {
-		log_warn("TYPING 0 read???");
-	} else {
-		log_warn("TYPING read error: %d (%s)", errno, strerror(errno));
+		if(cnt == 0) {
+			log_warn("TYPING 0 read???");
+		} else if(errno != EAGAIN) {
+			log_warn("TYPING read error: %d (%s)", errno, strerror(errno));
+		}
+		break;
 	}
 }
 
@@ -86,6 +106,7 @@ static void typing_io_proc(io_atom *inatom, int flags)
 static void cherr_proc(io_atom *inatom, int flags)
 {
 	heavy_atom *atom = (heavy_atom*)inatom;
+	task_spec *spec = atom->refcon;
 	char buf[512];
 	int cnt;
 
@@ -108,7 +129,7 @@ static void cherr_proc(io_atom *inatom, int flags)
 		log_warn("CHILD STDERR fd=%d: <<<%.*s>>>", atom->atom.fd, cnt, buf);
 	} else if(cnt == 0) {
 		// eof on stderr.
-		io_del(&atom->atom);
+		io_del(spec->master->io, &atom->atom);
 		log_info("Closed FD %d: got EOF on child stderr.", atom->atom.fd);
 		atom->atom.fd = -1;
 	} else {
@@ -127,13 +148,16 @@ static void rzt_destructor_proc(task_spec *spec, int free_mem)
 	// if the maout zfin scanner saved some text for us, we
 	// need to manually re-insert it into the pipe.
 	zfinscanstate *maout = (zfinscanstate*)spec->maout_refcon;
-	if(maout->savebuf) {
-		log_dbg("RESTORE %d saved bytes into pipe: %s",
-				maout->savecnt, sanitize(maout->savebuf, maout->savecnt));
-		pipe_write(&spec->master->master_output, maout->savebuf, maout->savecnt);
+	if(maout->savecnt) {
+		log_dbg("RESTORE %d saved bytes into pipe", maout->savecnt);
+		zfin_restore(maout, &spec->master->master_output);
 	}
 
 	if(free_mem) {
+		// the transfer is over so let the fifos shrink back down
+		pipe_set_minsize(&spec->master->input_master, inma_fifo_size);
+		pipe_set_minsize(&spec->master->master_output, maou_fifo_size);
+
 		zfin_destroy(spec->inma_refcon);
 		zfin_destroy(spec->maout_refcon);
 	}
@@ -142,6 +166,76 @@ static void rzt_destructor_proc(task_spec *spec, int free_mem)
 }
 
 
+/** Adds the file that just arrived to the manifest in the download
+ *  directory.  It's in the format sha256sum uses, so "sha256sum -c"
+ *  can check the files later without our having to read them again.
+ *
+ *  The name comes from the sender so it can't be trusted.  A newline
+ *  or backslash is escaped the way sha256sum does it (the line starts
+ *  with a backslash), and a name with any other control character is
+ *  left out rather than risk writing something sha256sum misreads.
+ */
+
+static void manifest_add(zinfo *info, const unsigned char digest[32])
+{
+	char path[PATH_MAX];
+	const unsigned char *cp;
+	int escape = 0;
+	FILE *fp;
+	int i;
+
+	if(!info->rawname[0]) {
+		log_warn("Not adding %s to the manifest: its name is too long", info->filename);
+		return;
+	}
+	for(cp=(const unsigned char*)info->rawname; *cp; cp++) {
+		if(*cp == '\\' || *cp == '\n') {
+			escape = 1;
+		} else if(*cp < ' ' || *cp == 0177) {
+			log_warn("Not adding %s to the manifest: its name has control characters", info->filename);
+			return;
+		}
+	}
+
+	if(download_dir && rz_manifest[0] != '/') {
+		snprintf(path, sizeof(path), "%s/%s", download_dir, rz_manifest);
+	} else {
+		snprintf(path, sizeof(path), "%s", rz_manifest);
+	}
+
+	fp = fopen(path, "a");
+	if(fp == NULL) {
+		log_warn("Could not open manifest %s: %s", path, strerror(errno));
+		return;
+	}
+
+	if(escape) {
+		putc('\\', fp);
+	}
+	for(i=0; i<32; i++) {
+		fprintf(fp, "%02x", digest[i]);
+	}
+	fputs("  ", fp);
+	for(cp=(const unsigned char*)info->rawname; *cp; cp++) {
+		if(*cp == '\\') {
+			fputs("\\\\", fp);
+		} else if(*cp == '\n') {
+			fputs("\\n", fp);
+		} else {
+			putc(*cp, fp);
+		}
+	}
+	putc('\n', fp);
+
+	if(fclose(fp) != 0) {
+		log_warn("Could not write manifest %s: %s", path, strerror(errno));
+		return;
+	}
+
+	log_info("Added %s to manifest %s", info->filename, path);
+}
+
+
 static task_spec* rz_create_spec(master_pipe *mp, int fd[3], int child_pid)
 {
 	task_spec *spec = task_create_spec();
@@ -158,11 +252,19 @@ static task_spec* rz_create_spec(master_pipe *mp, int fd[3], int child_pid)
 	spec->maout_proc = zfin_scan;
 	spec->maout_refcon = zfin_create(mp, zfin_nooo);
 	
-	spec->idle_proc = idle_proc;
-	spec->idle_refcon = idle_create(mp, "rz");
+	spec->idle_refcon = idle_create(spec, mp, "rz");
+	if(rz_manifest) {
+		((idle_state*)spec->idle_refcon)->info.hashed_proc = manifest_add;
+	}
+	if(!opt_quiet || rz_manifest) {
+		idle_state *idle = (idle_state*)spec->idle_refcon;
+		((zfinscanstate*)spec->inma_refcon)->decoder = &idle->from_receiver;
+		((zfinscanstate*)spec->maout_refcon)->decoder = &idle->from_sender;
+	}
 
 	spec->destruct_proc = rzt_destructor_proc;
 	spec->err_proc = cherr_proc;
+	spec->err_refcon = spec;
 	spec->verso_input_proc = typing_io_proc;
 	spec->verso_input_refcon = spec;
 
@@ -170,11 +272,41 @@ static task_spec* rz_create_spec(master_pipe *mp, int fd[3], int child_pid)
 }
 
 
+/** Tries to grow the kernel's buffer for the pipe to rz_pipe_size.
+ *  If the system won't allow that much, we settle for as much as
+ *  we can get.
+ *
+ *  @returns the pipe's size, or 0 if it can't be determined.
+ */
+
+static int grow_pipe(int fd)
+{
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	int size;
+
+	for(size = rz_pipe_size; size > 4096; size /= 2) {
+		if(fcntl(fd, F_SETPIPE_SZ, size) >= 0) {
+			break;
+		}
+		log_dbg("couldn't grow pipe %d to %d bytes: %s",
+				fd, size, strerror(errno));
+	}
+
+	size = fcntl(fd, F_GETPIPE_SZ);
+	return size > 0 ? size : 0;
+#else
+	return 0;
+#endif
+}
+
+
 /** Forks the zmodem receive process.  Fills in outfds with the fds
- *  of the new process, and child_pid with its pid.
+ *  of the new process, and child_pid with its pid.  Fills in pipesz
+ *  with the sizes of the pipes to and from the child's stdin and
+ *  stdout (or 0 if they weren't resized).
  */
 
-static void fork_rz_process(master_pipe *mp, int outfds[3], int *child_pid)
+static void fork_rz_process(master_pipe *mp, int outfds[3], int *child_pid, int pipesz[2])
 {
 	int chstdin[2];
 	int chstdout[2];
@@ -194,6 +326,14 @@ static void fork_rz_process(master_pipe *mp, int outfds[3], int *child_pid)
 		bail(79);
 	}
 
+	pipesz[0] = pipesz[1] = 0;
+	if(rz_pipe_size > 0) {
+		pipesz[0] = grow_pipe(chstdout[0]);
+		pipesz[1] = grow_pipe(chstdin[1]);
+		log_info("rz child pipes: stdout %d bytes, stdin %d bytes",
+				pipesz[0], pipesz[1]);
+	}
+
 	log_info("New FD to write to rz child stdin: %d", chstdin[1]);
 	log_info("New FD to read from rz child stdout: %d", chstdout[0]);
 	log_info("New FD to read from rz child stderr: %d", chstderr[0]);
@@ -221,7 +361,7 @@ static void fork_rz_process(master_pipe *mp, int outfds[3], int *child_pid)
 		chdir_to_dldir();
 		task_fork_prepare(mp);
 		rzh_fork_prepare();
-		io_exit_check();
+		io_exit_check(mp->io);
 
 		execv(rzcmd.path, rzcmd.args);
 		fprintf(stderr, "Could not exec /usr/bin/rz: %s\n",
@@ -244,9 +384,19 @@ void rztask_install(master_pipe *mp)
 {
 	int fds[3];
 	int child_pid;
+	int pipesz[2];
 
 	log_info("Forking background rz process, installing task.");
-	fork_rz_process(mp, fds, &child_pid);
+	fork_rz_process(mp, fds, &child_pid, pipesz);
 	task_install(mp, rz_create_spec(mp, fds, child_pid));
+
+	// size the fifos to match the pipes so each read and write can
+	// move as much as the kernel will hold.
+	if(pipesz[0] > 0) {
+		pipe_set_minsize(&mp->input_master, pipesz[0]);
+	}
+	if(pipesz[1] > 0) {
+		pipe_set_minsize(&mp->master_output, pipesz[1]);
+	}
 }
 
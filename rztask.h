@@ -1,5 +1,8 @@
 void rztask_install(master_pipe *mp);
 
+extern int rz_pipe_size;
+extern const char *rz_manifest;
+
 // the rzh program to launch
 extern const char *cmd_name;
 extern const char *cmd_exec;
@@ -0,0 +1,25 @@
+/* sha256.h
+ * Scott Bronson
+ *
+ * SHA-256 (FIPS 180-4), fed a piece at a time.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;				///< bytes hashed so far
+	unsigned char buf[64];		///< the partial block (count % 64 bytes of it)
+} sha256_ctx;
+
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, unsigned char digest[32]);
+
+#endif
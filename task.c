@@ -16,37 +16,42 @@
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
+#include "pool.h"
 #include "task.h"
 #include "util.h"
 
 
 int inma_fifo_size = 8192;
 int maou_fifo_size = 8192;
+int fifo_max_size = 1024*1024;	// how far a fifo may inflate when its writer stalls
+
+static __thread struct pool task_state_pool = POOL_INIT("task_state", task_state);
+static __thread struct pool task_spec_pool = POOL_INIT("task_spec", task_spec);
 
 
 /** This uses the spec to set up all the memory and atoms
  *  needed by the task.  It doesn't actually install the task.
  */
 
-static task_state* task_prepare(task_spec *spec)
+static task_state* task_prepare(master_pipe *mp, task_spec *spec)
 {
 	task_state *task;
 	int err;
 
-	task = malloc(sizeof(task_state));
+	task = pool_alloc(&task_state_pool);
 	if(task == NULL) {
 		perror("allocating task");
 		bail(42);
 	}
 
 	if(spec->infd >= 0) {
-		pipe_atom_init(&task->read_atom, spec->infd);
+		pipe_atom_init(mp->io, &task->read_atom, spec->infd);
 	} else {
 		task->read_atom.atom.fd = -1;
 	}
 
 	if(spec->outfd >= 0) {
-		pipe_atom_init(&task->write_atom, spec->outfd);
+		pipe_atom_init(mp->io, &task->write_atom, spec->outfd);
 	} else {
 		task->write_atom.atom.fd = -1;
 	}
@@ -55,7 +60,7 @@ static task_state* task_prepare(task_spec *spec)
 		task->err_atom.refcon = spec->err_refcon;
 		set_nonblock(spec->errfd);
 		io_atom_init(&task->err_atom.atom, spec->errfd, spec->err_proc);
-		err = io_add(&task->err_atom.atom, IO_READ);
+		err = io_add(mp->io, &task->err_atom.atom, IO_READ);
 		if(err != 0) {
 			fprintf(stderr, "%d (%s) setting up err atom for fd %d",
 					err, strerror(-err), spec->errfd);
@@ -73,7 +78,7 @@ static task_state* task_prepare(task_spec *spec)
 }
 
 
-static void task_destroy(task_state *task, int free_mem)
+static void task_destroy(master_pipe *mp, task_state *task, int free_mem)
 {
 	if(task->read_atom.atom.fd >= 0) {
 		log_dbg("task_destroy: destroying read atom, fd=%d",
@@ -88,14 +93,34 @@ static void task_destroy(task_state *task, int free_mem)
 	if(task->err_atom.atom.fd >= 0) {
 		log_dbg("task_destroy: destroying error atom, fd=%d",
 				task->err_atom.atom.fd);
-		io_del(&task->err_atom.atom);
+		io_del(mp->io, &task->err_atom.atom);
 	}
 
 	(*task->spec->destruct_proc)(task->spec, free_mem);
 
 	log_dbg("destroyed task state at 0x%08lX", (long)task);
 	if(free_mem) {
-		free(task);
+		pool_free(&task_state_pool, task);
+	}
+}
+
+
+/** Makes sure that the atom will be told when it has data.
+ *  Edge-triggered, it's always watched, but the data may have
+ *  arrived while somebody else was handling the atom's events.
+ *  If the backend does the pipes' i/o, a pipe atom isn't watched
+ *  (it may have been watched while it was a verso); pipe_resume
+ *  queues its read.
+ */
+
+static void task_enable_read(pipe_atom *atom)
+{
+	if(io_edge_triggered(atom->io)) {
+		io_pend(atom->io, &atom->atom, IO_READ);
+	} else if(io_can_transfer(atom->io) && atom->atom.proc == pipe_io_proc) {
+		io_disable(atom->io, &atom->atom, IO_READ);
+	} else {
+		io_enable(atom->io, &atom->atom, IO_READ);
 	}
 }
 
@@ -110,6 +135,11 @@ static void task_pipe_setup(master_pipe *mp)
 {
 	task_state *task = mp->task_head;
 
+	// The atoms are about to change hands, so get back any reads
+	// and writes that the backend is doing on them.
+	pipe_quiesce(&mp->input_master);
+	pipe_quiesce(&mp->master_output);
+
 	// Handle verso first.  We need to restore the read proc on this task
 	// to its original state (eradicate any verso from a subtask).  This
 	// means that read atoms in normal usage MUST be pipe endpoints.
@@ -125,7 +155,7 @@ static void task_pipe_setup(master_pipe *mp)
 			verso->read_atom.atom.proc = task->spec->verso_input_proc;
 			verso->read_atom.read_pipe = task->spec->verso_input_refcon;
 			// ensure that reading is enabled
-			io_enable(&verso->read_atom.atom, IO_READ);
+			task_enable_read(&verso->read_atom);
 		}
 	}
 
@@ -136,9 +166,16 @@ static void task_pipe_setup(master_pipe *mp)
 	task->write_atom.write_pipe = &mp->master_output;
 
 	// New reader so reset the read status
-	mp->input_master.block_read = 0;
+	pipe_unblock_read(&mp->input_master);
 	if(mp->input_master.read_atom->atom.fd >= 0) {
-		io_enable(&mp->input_master.read_atom->atom, IO_READ);
+		task_enable_read(mp->input_master.read_atom);
+	}
+
+	// Edge-triggered, a writer that was ready while it was covered
+	// won't signal again, so get any waiting data moving.
+	if(io_edge_triggered(mp->io) && task->write_atom.atom.fd >= 0 &&
+			fifo_count(&mp->master_output.fifo)) {
+		io_pend(mp->io, &task->write_atom.atom, IO_WRITE);
 	}
 
 	// Ensure the fifo procs are set up
@@ -146,6 +183,9 @@ static void task_pipe_setup(master_pipe *mp)
 	mp->input_master.fifo.refcon = task->spec->inma_refcon;
 	mp->master_output.fifo.proc = task->spec->maout_proc;
 	mp->master_output.fifo.refcon = task->spec->maout_refcon;
+
+	pipe_resume(&mp->input_master);
+	pipe_resume(&mp->master_output);
 }
 
 
@@ -154,7 +194,7 @@ static void task_pipe_setup(master_pipe *mp)
 
 void task_install(master_pipe *mp, task_spec *spec)
 {
-	task_state *task = task_prepare(spec);
+	task_state *task = task_prepare(mp, spec);
 
 	log_dbg("Installing task state 0x%08lX at top of list.", (long)task);
 
@@ -182,11 +222,11 @@ void task_remove(master_pipe *mp)
 		// restore the prevous task in the pipe
 		log_dbg("Removing topmost task state 0x%08lX, restoring next at 0x%08lX.", (long)task, (long)mp->task_head);
 		task_pipe_setup(mp);
-		task_destroy(task, 1);
+		task_destroy(mp, task, 1);
 	} else {
 		// no more tasks, call the pipe destructor
 		log_dbg("Removing last task 0x%08lX, calling master destructor.", (long)task);
-		task_destroy(task, 1);
+		task_destroy(mp, task, 1);
 		(*mp->destruct_proc)(mp, 1);
 	}
 }
@@ -223,7 +263,7 @@ void task_default_destructor(task_spec *spec, int free_mem)
 	// We'll do nothing with the child pid.
 
 	if(free_mem) {
-		free(spec);
+		pool_free(&task_spec_pool, spec);
 	}
 }
 
@@ -250,6 +290,8 @@ static task_state* master_pipe_find_task(master_pipe *mp, task_spec *spec)
 void task_default_sigchild(master_pipe *mp, task_spec *spec, int pid)
 {
 	task_state *task;
+	struct fifo *f;
+	uint64_t moved, got;
 	// TODO: technically, calling printf inside a signal handler is
 	// illegal.  Get rid of these logging calls eventually.
 
@@ -268,14 +310,35 @@ void task_default_sigchild(master_pipe *mp, task_spec *spec, int pid)
 		// We got a sigchld for this task, but the reader hasn't
 		// been closed yet.  This means there's probably a touch
 		// more data in the read pipe.  Read it to exhaustion.
-		while(task->read_atom.atom.fd != -1) {
+		f = &mp->input_master.fifo;
+		moved = f->stats.bytes_in + f->stats.bytes_out;
+		while(task->read_atom.atom.fd != -1 && !mp->input_master.block_read) {
 			// probably we just found the eof and no actual data.
 			log_info("Found extra data in pipe %d:", task->read_atom.atom.fd);
+			got = f->stats.bytes_in;
 			pipe_io_proc(&task->read_atom.atom, IO_READ);
+			if(f->stats.bytes_in == got) {
+				// EAGAIN: somebody else still holds the other end open.
+				break;
+			}
 		}
 		if(mp->input_master.write_atom->atom.fd >= 0) {
-			log_info("Wrote extra %d bytes of data to %d", fifo_count(&mp->input_master.fifo), mp->input_master.write_atom->atom.fd);
-			fifo_write(&mp->input_master.fifo, mp->input_master.write_atom->atom.fd);
+			log_info("Wrote extra %d bytes of data to %d", fifo_count(f), mp->input_master.write_atom->atom.fd);
+			pipe_quiesce(&mp->input_master);
+			fifo_write(f, mp->input_master.write_atom->atom.fd);
+		}
+		// the fifo was full so the reader was blocked.  There
+		// may be room now.
+		if(fifo_avail(f)) {
+			pipe_unblock_read(&mp->input_master);
+		}
+		pipe_resume(&mp->input_master);
+		if(task->read_atom.atom.fd != -1 && f->stats.bytes_in + f->stats.bytes_out == moved) {
+			// Neither side will budge.  Don't spin waiting for them;
+			// the task is going away so whatever's left is lost.
+			log_warn("Giving up on the rest of pipe %d (%d bytes still in the fifo)",
+					task->read_atom.atom.fd, fifo_count(f));
+			break;
 		}
 	}
 
@@ -324,12 +387,10 @@ void task_default_terminate(master_pipe *mp, task_spec *spec)
 
 task_spec* task_create_spec()
 {
-	// calloc is giving me trouble; dunno why.
-	task_spec *spec = malloc(sizeof(task_spec));
+	task_spec *spec = pool_alloc(&task_spec_pool);
 	if(spec == NULL) {
 		return NULL;
 	}
-	memset(spec, 0, sizeof(task_spec));
 
 	spec->infd = -1;
 	spec->outfd = -1;
@@ -354,7 +415,7 @@ void task_fork_prepare(master_pipe *mp)
 	task_state *task = mp->task_head;
 
 	while(task) {
-		task_destroy(task, 0);
+		task_destroy(mp, task, 0);
 		task = task->next;
 	}
 
@@ -383,6 +444,50 @@ void task_dispatch_sigchild(master_pipe *mp, int pid)
 }
 
 
+static void task_dump_atom(const char *name, io_atom *atom)
+{
+	if(atom->fd >= 0) {
+		fprintf(stderr, " %s fd %d", name, atom->fd);
+		if(atom->proc != pipe_io_proc) {
+			fprintf(stderr, " (verso)");
+		}
+	}
+}
+
+
+/** Prints every task, pipe, and atom in the master pipe to stderr with
+ *  their counters.  Triggered by sending rzh a SIGUSR1.
+ */
+
+void master_pipe_dump(master_pipe *mp)
+{
+	task_state *task;
+	int i = 0;
+
+	fprintf(stderr, "\r\nrzh %d: master fd %d, %s backend%s\r\n", (int)getpid(),
+			mp->master_atom.atom.fd, io_backend_name(mp->io),
+			io_edge_triggered(mp->io) ? " (edge-triggered)" : "");
+	pipe_dump(&mp->input_master, "input->master");
+	pipe_dump(&mp->master_output, "master->output");
+
+	for(task = mp->task_head; task; task = task->next) {
+		fprintf(stderr, "  task %d:", i++);
+		if(task->spec->child_pid > 0) {
+			fprintf(stderr, " pid %d", task->spec->child_pid);
+		}
+		task_dump_atom("in", &task->read_atom.atom);
+		task_dump_atom("out", &task->write_atom.atom);
+		if(task->err_atom.atom.fd >= 0) {
+			fprintf(stderr, " err fd %d", task->err_atom.atom.fd);
+		}
+		fprintf(stderr, "\r\n");
+	}
+
+	pool_dump();
+	fflush(stderr);
+}
+
+
 /** The default destructor for master pipes.
  *  free_mem is set to 0 if we're forking, or 1 if we're quitting.
  *  No need to free mem before forking since everything will be
@@ -417,18 +522,19 @@ void master_pipe_default_terminate(master_pipe *mp)
 /** For now the master must read and write the same fd.
  */
 
-master_pipe* master_pipe_init(int masterfd)
+master_pipe* master_pipe_init(io_ctx *io, int masterfd)
 {
 	master_pipe *mp = malloc(sizeof(master_pipe));
 	if(mp == NULL) {
 		return NULL;
 	}
 	memset(mp, 0, sizeof(master_pipe));
+	mp->io = io;
 
-	pipe_atom_init(&mp->master_atom, masterfd);
+	pipe_atom_init(io, &mp->master_atom, masterfd);
 
-	pipe_init(&mp->input_master, NULL, &mp->master_atom, inma_fifo_size);
-	pipe_init(&mp->master_output, &mp->master_atom, NULL, maou_fifo_size);
+	pipe_init(io, &mp->input_master, NULL, &mp->master_atom, inma_fifo_size, fifo_max_size);
+	pipe_init(io, &mp->master_output, &mp->master_atom, NULL, maou_fifo_size, fifo_max_size);
 
 	mp->destruct_proc = master_pipe_default_destructor;
 	mp->sigchild_proc = master_pipe_default_sigchild;
@@ -6,6 +6,17 @@
  * when we fork rzh, we're creating a task to insert.  This is a way
  * of trying to keep the complexity manageable.  You should have seen
  * this code before it was organized into tasks and pipes!
+ *
+ * Each master pipe, and everything in it, belongs to one io_ctx and
+ * must only be touched by the thread running that context's loop.
+ * Several loops may run at once, one per thread, because the state
+ * they'd otherwise share is kept per thread: the object pools (see
+ * pool.h), the fifo buffer cache, and the zmodem decoder's tables.
+ * The tunables (fifo sizes, read budgets, fifo_pow2, zmark_simd, the
+ * io_use defaults and so on) are only set at startup, before any loop
+ * runs, so they're safe to share, and any thread may write to the log
+ * once it's open.  The console is not: bgio's pty and SIGCHLD handling
+ * belong to the process, so only one loop may run the console task.
  */
 
 
@@ -35,15 +46,11 @@ typedef struct task_spec {
 	// Right now, verso output is a complete hack.  It works though.
 	// The entire pipe_atom is available for use by the verso read proc, since it gets entirely reset by task_pipe_setup.  Cool!
 
-/** The idle proc of the topmost task gets called once each time through
- *  the event loop.  It returns the number of milliseconds that should
- *  elapse before being called again.  Note that it is called EVERY time
- *  through the event loop so it will probably get called much more
- *  often than it requests.
+/** A task that needs to do something periodically (like update the
+ *  progress display) arms an io_timer.  This is where it can keep it.
  */
 
-	int (*idle_proc)(struct task_spec*);			///< The idle proc to call when this task is topmost.
-	void *idle_refcon;								///< Any data you want to associate explicitly with the idle proc.
+	void *idle_refcon;								///< Any data you want to associate explicitly with the task's timer.
 
 	void (*destruct_proc)(struct task_spec*, int free_mem);	///< Called when the task gets removed so the task_spec is no longer needed (unless you want to reuse it of course).  This routine is to free all memory, etc.  If forking is true, then we're running in a child that is about to exec, so close all filehandles but don't worry about memory.  The new task is established, but no I/O has occurred, when the previous task's destructor is called.
 	void (*sigchild_proc)(struct master_pipe*, struct task_spec*, int pid);	///< The SIGCHLD handler for this task.  See task_sigchild() for more.  This is set to task_default_sigchild by default.  If your task doesn't involve forked children, just leave task_spec::child_pid set to -1.
@@ -77,6 +84,7 @@ typedef struct task_state {
  */
 
 typedef struct master_pipe {
+	io_ctx *io;					///< The event loop that runs the pipe and all its tasks.
 	pipe_atom master_atom;		///< The fd of the master, both read and write.
 	struct pipe input_master;	///< The pipe shuttling data from the input to the master.
 	struct pipe master_output;	///< The pipe shuttling data from the master to the output.
@@ -90,6 +98,7 @@ typedef struct master_pipe {
 
 extern int inma_fifo_size;
 extern int maou_fifo_size;
+extern int fifo_max_size;
 
 void task_install(master_pipe *mp, task_spec *spec);
 void task_remove(master_pipe *mp);
@@ -102,7 +111,8 @@ void task_default_destructor(task_spec *spec, int free_mem);
 void task_dispatch_sigchild(master_pipe *mp, int pid);
 void task_fork_prepare(master_pipe *mp);
 
-master_pipe* master_pipe_init(int masterfd);
+master_pipe* master_pipe_init(io_ctx *io, int masterfd);
 void master_pipe_default_destructor(master_pipe *mp, int free_mem);
 void master_pipe_terminate(master_pipe *mp);
+void master_pipe_dump(master_pipe *mp);
 
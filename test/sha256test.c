@@ -0,0 +1,93 @@
+/* sha256test.c
+ *
+ * Checks sha256.c against the FIPS 180-2 test vectors, fed both all
+ * at once and in odd-sized pieces so the partial block gets a workout.
+ *
+ * Prints nothing if everything checks out.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../sha256.h"
+
+
+static int errors;
+
+
+static void check(const char *name, const unsigned char digest[32], const char *want)
+{
+	char got[65];
+	int i;
+
+	for(i=0; i<32; i++) {
+		sprintf(got + 2*i, "%02x", digest[i]);
+	}
+
+	if(strcmp(got, want) != 0) {
+		printf("%s: got %s\n%*s  wanted %s\n", name, got, (int)strlen(name), "", want);
+		errors += 1;
+	}
+}
+
+
+/** Hashes msg whole, then a byte at a time. */
+
+static void check_msg(const char *name, const char *msg, const char *want)
+{
+	unsigned char digest[32];
+	sha256_ctx ctx;
+	size_t i;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, msg, strlen(msg));
+	sha256_final(&ctx, digest);
+	check(name, digest, want);
+
+	sha256_init(&ctx);
+	for(i=0; i<strlen(msg); i++) {
+		sha256_update(&ctx, msg + i, 1);
+	}
+	sha256_final(&ctx, digest);
+	check(name, digest, want);
+}
+
+
+/** One million 'a's, in pieces that straddle the block boundaries. */
+
+static void check_million()
+{
+	static const size_t sizes[] = { 1, 3, 7, 13, 31, 63, 64, 65, 127, 1000, 4093 };
+	const char *want = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+	unsigned char digest[32];
+	char buf[4096];
+	sha256_ctx ctx;
+	size_t left = 1000000, n;
+	int i = 0;
+
+	memset(buf, 'a', sizeof(buf));
+
+	sha256_init(&ctx);
+	while(left > 0) {
+		n = sizes[i++ % (sizeof(sizes)/sizeof(sizes[0]))];
+		if(n > left) n = left;
+		sha256_update(&ctx, buf, n);
+		left -= n;
+	}
+	sha256_final(&ctx, digest);
+	check("million a", digest, want);
+}
+
+
+int main()
+{
+	check_msg("empty", "",
+			"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+	check_msg("abc", "abc",
+			"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	check_msg("448 bits", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+			"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+	check_million();
+
+	return errors ? 1 : 0;
+}
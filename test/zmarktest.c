@@ -0,0 +1,182 @@
+/* zmarktest.c
+ *
+ * Checks the zmodem marker scanner (zmark.c).  Every marker in the
+ * generated DFA is run through zmark_run split at every possible
+ * place, with each skip kernel the CPU can run, and the kernels are
+ * checked against each other directly.
+ *
+ * Prints nothing if everything checks out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// included rather than linked so we can get at the kernels
+#include "../zmark.c"
+
+
+struct kernel {
+	const char *name;
+	const char* (*skip)(const char *cp, const char *ce);
+};
+
+static struct kernel kernels[4];
+static int num_kernels;
+static int errors;
+
+
+static void find_kernels()
+{
+	kernels[num_kernels].name = "scalar";
+	kernels[num_kernels++].skip = skip_scalar;
+
+#ifdef ZMARK_HAVE_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		kernels[num_kernels].name = "sse2";
+		kernels[num_kernels++].skip = skip_sse2;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		kernels[num_kernels].name = "avx2";
+		kernels[num_kernels++].skip = skip_avx2;
+	}
+#endif
+}
+
+
+/** Returns text with the control characters spelled out. */
+
+static const char* shown(const char *text)
+{
+	static char buf[128];
+	char *cp = buf;
+
+	for(; *text && cp < buf + sizeof(buf) - 5; text++) {
+		if(*text >= ' ' && *text < 127) {
+			*cp++ = *text;
+		} else {
+			cp += sprintf(cp, "\\%03o", (unsigned char)*text);
+		}
+	}
+	*cp = '\0';
+
+	return buf;
+}
+
+
+/** Scans buf in two pieces, split at split.  Returns the offset just
+ *  past the first marker found (and sets *marker), or -1.
+ */
+
+static int scan_split(const char *buf, int len, int split, int *marker)
+{
+	const char *pieces[3] = { buf, buf + split, buf + len };
+	const char *cp;
+	zmark zm;
+	int i;
+
+	zmark_init(&zm);
+	for(i=0; i<2; i++) {
+		cp = pieces[i];
+		while(cp < pieces[i+1]) {
+			cp = zmark_run(&zm, cp, pieces[i+1], marker);
+			if(*marker != ZMARK_NONE) {
+				return cp - buf;
+			}
+		}
+	}
+
+	*marker = ZMARK_NONE;
+	return -1;
+}
+
+
+/** Buries the marker in enough ordinary text that the SIMD kernels
+ *  get a few full loads on either side, then makes sure it's found,
+ *  and found in the right place, however the buffer is split.
+ */
+
+static void check_marker(int k, const char *text, int want)
+{
+	static const char before[] = "total 48 -rw-r--r-- 1 user user 1234 Jan 1 12:00 file.txt ";
+	static const char after[] = " and then some more output from the shell, 0123456789";
+	char buf[256];
+	int len, end, split, got, marker;
+
+	len = sprintf(buf, "%s%s%s", before, text, after);
+	end = strlen(before) + strlen(text);
+
+	for(split=0; split<=len; split++) {
+		got = scan_split(buf, len, split, &marker);
+		if(got != end || marker != want) {
+			printf("%s: marker %d (\"%s\") split at %d: got %d at %d, wanted %d at %d\n",
+					kernels[k].name, want, shown(text), split, marker, got, want, end);
+			errors += 1;
+		}
+	}
+}
+
+
+/** The SIMD kernels have to stop at exactly the byte the scalar one
+ *  does, wherever the buffer starts and ends.
+ */
+
+static void check_kernels()
+{
+	char buf[160];
+	const char *want, *got;
+	int i, k, beg, end;
+
+	for(i=0; i<(int)sizeof(buf); i++) {
+		buf[i] = 'a' + i % 26;
+	}
+	// a few bytes that could start a marker, scattered about
+	for(i=0; i<ZMARK_NFIRST; i++) {
+		buf[37 + 41*i] = zmark_first[i];
+	}
+
+	for(beg=0; beg<(int)sizeof(buf); beg++) {
+		for(end=beg; end<=(int)sizeof(buf); end++) {
+			want = skip_scalar(buf + beg, buf + end);
+			for(k=1; k<num_kernels; k++) {
+				got = (*kernels[k].skip)(buf + beg, buf + end);
+				if(got != want) {
+					printf("%s: skipping [%d,%d) stopped at %d, scalar stopped at %d\n",
+							kernels[k].name, beg, end,
+							(int)(got - buf), (int)(want - buf));
+					errors += 1;
+				}
+			}
+		}
+	}
+}
+
+
+int main()
+{
+	int k, st, markers = 0;
+
+	log_set_priority(0);
+	find_kernels();
+
+	for(k=0; k<num_kernels; k++) {
+		skip = kernels[k].skip;
+		// every state that finds a marker spells out its whole pattern
+		for(st=0; st<ZMARK_STATES; st++) {
+			if(zmark_found[st] != ZMARK_NONE) {
+				check_marker(k, zmark_texts[st], zmark_found[st]);
+				markers += 1;
+			}
+		}
+	}
+
+	if(markers == 0) {
+		printf("no markers in the DFA!\n");
+		errors += 1;
+	}
+
+	check_kernels();
+
+	return errors ? 1 : 0;
+}
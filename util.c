@@ -1,11 +1,16 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "bgio.h"
 #include "util.h"
@@ -15,12 +20,54 @@
 int g_highest_fd;
 
 
+#ifdef __linux__
+#define FD_DIR "/proc/self/fd"
+#else
+#define FD_DIR "/dev/fd"
+#endif
+
+
+/** Returns the highest fd that's open, or -1 if the fd directory
+ *  can't be read.
+ */
+
+static int scan_fd_dir()
+{
+	DIR *dir;
+	struct dirent *ent;
+	int fd, max = -1;
+
+	dir = opendir(FD_DIR);
+	if(dir == NULL) {
+		return -1;
+	}
+
+	while((ent = readdir(dir)) != NULL) {
+		if(ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+			continue;
+		}
+		fd = atoi(ent->d_name);
+		if(fd != dirfd(dir) && fd > max) {
+			max = fd;
+		}
+	}
+
+	closedir(dir);
+	return max;
+}
+
+
 int find_highest_fd()
 {
 	int i, err;
 
-	// Assume we'll never need more than 64 fds
-	for(i=64; i; i--) {
+	i = scan_fd_dir();
+	if(i >= 0) {
+		return i;
+	}
+
+	// No fd directory, so probe.  This is slow if the limit is high.
+	for(i=sysconf(_SC_OPEN_MAX) - 1; i >= 0; i--) {
 		err = fcntl(i, F_GETFL);
 		if(err != -1) {
 			return i;
@@ -32,6 +79,30 @@ int find_highest_fd()
 }
 
 
+/** Closes every fd above the given one. */
+
+static void close_fds_above(int fd)
+{
+	int i, max;
+
+#ifdef SYS_close_range
+	if(syscall(SYS_close_range, fd + 1, ~0U, 0) == 0) {
+		return;
+	}
+#endif
+
+	max = find_highest_fd();
+	for(i=fd+1; i<=max; i++) {
+		close(i);
+	}
+}
+
+
+/** Called before execing a child.  Complains about any fds that were
+ *  leaked (opened since rzh started), then closes them so the child
+ *  doesn't inherit them.
+ */
+
 void fdcheck()
 {
 	int now = find_highest_fd();
@@ -40,6 +111,8 @@ void fdcheck()
 		// can't send it to logfile because logfile has already been closed.
 		// Keep running because it's not a fatal error.
 	}
+
+	close_fds_above(g_highest_fd);
 }
 
 
@@ -0,0 +1,555 @@
+/* zdecode.c
+ * Scott Bronson
+ *
+ * A passive zmodem decoder.  It watches the bytes passing between the
+ * sender and rz and picks out just enough of the protocol to tell
+ * which file is being sent, how big it is, and how far along it is.
+ * It never changes or holds on to the data.  Everything it needs to
+ * remember is in the zdecoder so it doesn't care how the stream is
+ * chopped into packets.
+ *
+ * It doesn't need to be perfect.  Headers are checked against their
+ * CRCs so line noise can't send the display off into the weeds, but
+ * data subpackets usually aren't.  If one is bad, rz asks for it again
+ * with a ZRPOS and we see that.
+ *
+ * The exception is when the file is being hashed.  Then each data
+ * subpacket is hashed as it goes by but only kept if its CRC is good.
+ * After a bad subpacket rz ignores everything until the sender starts
+ * over with a ZDATA at the offset rz asked for, and so do we: nothing
+ * more is hashed until the sender's own ZDATA header names exactly the
+ * offset the hash has reached.  The hash ends up covering exactly what
+ * rz wrote, without anything having to be buffered.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sha256.h"
+#include "zdecode.h"
+
+
+#define ZPAD '*'
+#define ZDLE 030
+
+// header types (only the ones we care about)
+#define ZSINIT 2
+#define ZFILE 4
+#define ZRPOS 9
+#define ZDATA 10
+#define ZEOF 11
+#define ZCOMMAND 18
+
+// what can follow a ZDLE
+#define ZCRCE 'h'	// end of frame, header follows
+#define ZCRCG 'i'	// more data follows
+#define ZCRCQ 'j'	// more data follows, ZACK expected
+#define ZCRCW 'k'	// end of frame, ZACK expected
+#define ZRUB0 'l'	// 0177
+#define ZRUB1 'm'	// 0377
+
+// unescape() returns these along with the bytes
+#define NOTHING -1		// a ZDLE or flow control: no byte yet
+#define GARBAGE -2		// a bad escape or a cancel
+#define FRAMEEND 0x100	// or'd with the frame end character
+
+
+enum {
+	ST_IDLE,		// between frames, looking for ZPAD
+	ST_PAD,			// seen ZPAD, looking for ZDLE
+	ST_PADZDLE,		// seen ZPAD ZDLE, the next byte says what kind of header
+	ST_HEX,			// collecting a hex header
+	ST_BIN,			// collecting a binary header
+	ST_DATA,		// reading a data subpacket
+	ST_CRC,			// reading the CRC at the end of a subpacket
+};
+
+
+// Built the first time each thread creates a decoder so one thread
+// can't see another's half-built table.
+static __thread uint32_t crc16_tab[256];	// CRC-16/XMODEM, sent most significant byte first
+static __thread uint32_t crc32_tab[256];	// the usual CRC-32, sent least significant byte first
+
+#define updcrc16(crc, c) (((crc) << 8 ^ crc16_tab[((crc) >> 8 ^ (c)) & 0xff]) & 0xffff)
+#define updcrc32(crc, c) ((crc) >> 8 ^ crc32_tab[((crc) ^ (c)) & 0xff])
+
+
+static void make_crc_tables()
+{
+	uint32_t c16, c32;
+	int n, i;
+
+	for(n=0; n<256; n++) {
+		c16 = n << 8;
+		c32 = n;
+		for(i=0; i<8; i++) {
+			c16 = c16 & 0x8000 ? (c16 << 1) ^ 0x1021 : c16 << 1;
+			c32 = c32 & 1 ? (c32 >> 1) ^ 0xedb88320 : c32 >> 1;
+		}
+		crc16_tab[n] = c16 & 0xffff;
+		crc32_tab[n] = c32;
+	}
+}
+
+
+void zdec_init(zdecoder *zd, zinfo *info)
+{
+	if(!crc32_tab[1]) {
+		make_crc_tables();
+	}
+
+	memset(zd, 0, sizeof(*zd));
+	zd->info = info;
+	zd->state = ST_IDLE;
+}
+
+
+static uint32_t crc_update(zdecoder *zd, uint32_t crc, const unsigned char *buf, int len)
+{
+	if(zd->crc32) {
+		while(len--) {
+			crc = updcrc32(crc, *buf++);
+		}
+	} else {
+		while(len--) {
+			crc = updcrc16(crc, *buf++);
+		}
+	}
+
+	return crc;
+}
+
+
+/** Starts the CRC for a header or subpacket. */
+
+static uint32_t crc_start(zdecoder *zd)
+{
+	return zd->crc32 ? 0xffffffff : 0;
+}
+
+
+/** Checks the CRC that was sent (in zd->hdr starting at cp) against
+ *  the one we computed.
+ */
+
+static int crc_good(zdecoder *zd, uint32_t crc, const unsigned char *cp)
+{
+	if(zd->crc32) {
+		return ~crc == (cp[0] | cp[1] << 8 | cp[2] << 16 | (uint32_t)cp[3] << 24);
+	}
+
+	// running the sent CRC through a CRC-16 always leaves 0
+	return crc_update(zd, crc, cp, 2) == 0;
+}
+
+
+/** Undoes ZDLE escaping one byte at a time.
+ *  @returns the byte, NOTHING, GARBAGE, or FRAMEEND|c.
+ */
+
+static int unescape(zdecoder *zd, int c)
+{
+	if(zd->esc) {
+		zd->esc = 0;
+		switch(c) {
+			case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+				return FRAMEEND | c;
+			case ZRUB0:
+				return 0177;
+			case ZRUB1:
+				return 0377;
+		}
+		// anything else (including a second CAN) is an error.
+		return (c & 0140) == 0100 ? c ^ 0100 : GARBAGE;
+	}
+
+	if(c == ZDLE) {
+		zd->esc = 1;
+		return NOTHING;
+	}
+
+	// receivers ignore raw XON and XOFF
+	if((c & 0177) == 021 || (c & 0177) == 023) {
+		return NOTHING;
+	}
+
+	return c;
+}
+
+
+static void start_header(zdecoder *zd, int c)
+{
+	zd->hlen = 0;
+	zd->esc = 0;
+	zd->hexhi = -1;
+
+	switch(c) {
+		case 'A':	// binary, 16-bit CRC
+			zd->state = ST_BIN;
+			zd->need = 7;
+			zd->crc32 = 0;
+			break;
+		case 'B':	// hex, 16-bit CRC
+			zd->state = ST_HEX;
+			zd->need = 7;
+			zd->crc32 = 0;
+			break;
+		case 'C':	// binary, 32-bit CRC
+			zd->state = ST_BIN;
+			zd->need = 9;
+			zd->crc32 = 1;
+			break;
+		default:
+			zd->state = ST_IDLE;
+	}
+}
+
+
+/** Called when the ZFILE subpacket is complete.  It holds the
+ *  filename, a NUL, then the length and some other numbers in ASCII.
+ */
+
+static void file_info(zdecoder *zd)
+{
+	zinfo *info = zd->info;
+	int n = strnlen(zd->sub, zd->sublen);
+	char *cp, *end;
+	long long size;
+	int i;
+
+	zd->sub[zd->sublen] = '\0';
+
+	for(i=0; i<n && i<sizeof(info->filename)-1; i++) {
+		unsigned char c = zd->sub[i];
+		info->filename[i] = c >= ' ' && c < 0177 ? c : '?';
+	}
+	info->filename[i] = '\0';
+
+	info->rawname[0] = '\0';
+	if(n < sizeof(info->rawname)) {
+		memcpy(info->rawname, zd->sub, n);
+		info->rawname[n] = '\0';
+	}
+
+	info->size = -1;
+	if(n < zd->sublen) {
+		cp = zd->sub + n + 1;
+		size = strtoll(cp, &end, 10);
+		if(end != cp && size >= 0) {
+			info->size = size;
+		}
+	}
+
+	info->offset = 0;
+	info->file_num += 1;
+
+	sha256_init(&info->sha);
+	info->hashed = 0;
+	info->hash_done = 0;
+
+	log_info("zdecode: file %d is \"%s\", %lld bytes", info->file_num,
+			info->filename, (long long)info->size);
+}
+
+
+/** Called when the sender says it has sent the whole file. */
+
+static void file_done(zinfo *info, uint64_t len)
+{
+	unsigned char digest[32];
+
+	if(!info->hashed_proc || !info->file_num || info->hash_done) {
+		return;
+	}
+
+	if(info->hashed != len) {
+		log_warn("zdecode: only saw %llu of the %llu bytes in %s, not hashing it",
+				(unsigned long long)info->hashed, (unsigned long long)len,
+				info->filename);
+		return;
+	}
+
+	sha256_final(&info->sha, digest);
+	info->hash_done = 1;
+	(*info->hashed_proc)(info, digest);
+}
+
+
+static void got_header(zdecoder *zd)
+{
+	const unsigned char *h = zd->hdr;
+	uint32_t pos;
+
+	if(!crc_good(zd, crc_update(zd, crc_start(zd), h, 5), h + 5)) {
+		log_dbg("zdecode: bad crc on header type %d", h[0]);
+		zd->state = ST_IDLE;
+		return;
+	}
+
+	// positions are sent least significant byte first
+	pos = h[1] | h[2] << 8 | h[3] << 16 | (uint32_t)h[4] << 24;
+	zd->state = ST_IDLE;
+
+	switch(h[0]) {
+		case ZRPOS:
+			zd->info->offset = pos;
+			break;
+
+		case ZEOF:
+			zd->info->offset = pos;
+			file_done(zd->info, pos);
+			break;
+
+		case ZDATA:
+			// The receiver's ZRPOS only moves the display.  The hash
+			// follows the data stream, which only the sender can place.
+			zd->info->offset = pos;
+			zd->pos = pos;
+			zd->pending = zd->info->sha;
+			zd->hend = zd->info->hashed;
+			zd->synced = (pos == zd->info->hashed);
+			if(!zd->synced && zd->info->hashed_proc) {
+				log_dbg("zdecode: data starts at %lu but the hash is at %llu, not hashing it",
+						(unsigned long)pos, (unsigned long long)zd->info->hashed);
+			}
+			// fall through
+		case ZFILE:
+		case ZSINIT:
+		case ZCOMMAND:
+			// a data subpacket follows
+			zd->frame = h[0];
+			zd->sublen = 0;
+			zd->esc = 0;
+			zd->crc = crc_start(zd);
+			zd->state = ST_DATA;
+			break;
+	}
+}
+
+
+static void end_subpacket(zdecoder *zd, int end)
+{
+	unsigned char c = end;
+
+	if(zd->frame == ZFILE) {
+		file_info(zd);
+		zd->frame = 0;		// ignore any more subpackets
+	}
+
+	// the frame end is covered by the CRC too
+	zd->crc = crc_update(zd, zd->crc, &c, 1);
+
+	zd->state = ST_CRC;
+	zd->hlen = 0;
+	zd->need = zd->crc32 ? 4 : 2;
+	zd->after = (end == ZCRCE || end == ZCRCW) ? ST_IDLE : ST_DATA;
+}
+
+
+/** Called when the CRC after a subpacket has been read.  If the file
+ *  is being hashed, this is where the subpacket is kept or thrown out.
+ */
+
+static void end_crc(zdecoder *zd)
+{
+	zinfo *info = zd->info;
+
+	if(zd->frame == ZDATA && info->hashed_proc) {
+		if(!crc_good(zd, zd->crc, zd->hdr)) {
+			// rz drops everything after this until the sender
+			// goes back to where rz wants it.
+			log_dbg("zdecode: bad crc on data subpacket ending at %llu",
+					(unsigned long long)zd->pos);
+			zd->synced = 0;
+			zd->pending = info->sha;
+			zd->hend = info->hashed;
+		} else if(zd->synced) {
+			info->sha = zd->pending;
+			info->hashed = zd->hend;
+		}
+	}
+
+	zd->crc = crc_start(zd);
+	zd->sublen = 0;
+	zd->state = zd->after;
+}
+
+
+static void hex_byte(zdecoder *zd, int c)
+{
+	int v;
+
+	c &= 0177;
+	if(c == 021 || c == 023) {
+		return;
+	}
+
+	if(c >= '0' && c <= '9') {
+		v = c - '0';
+	} else if(c >= 'a' && c <= 'f') {
+		v = c - 'a' + 10;
+	} else {
+		zd->state = ST_IDLE;
+		return;
+	}
+
+	if(zd->hexhi < 0) {
+		zd->hexhi = v;
+		return;
+	}
+
+	zd->hdr[zd->hlen++] = zd->hexhi << 4 | v;
+	zd->hexhi = -1;
+	if(zd->hlen >= zd->need) {
+		got_header(zd);
+	}
+}
+
+
+static void bin_byte(zdecoder *zd, int c)
+{
+	c = unescape(zd, c);
+	if(c == NOTHING) {
+		return;
+	}
+	if(c == GARBAGE || (c & FRAMEEND)) {
+		zd->state = ST_IDLE;
+		return;
+	}
+
+	if(zd->state == ST_CRC) {
+		zd->hdr[zd->hlen++] = c;
+		if(zd->hlen >= zd->need) {
+			end_crc(zd);
+		}
+		return;
+	}
+
+	zd->hdr[zd->hlen++] = c;
+	if(zd->hlen >= zd->need) {
+		got_header(zd);
+	}
+}
+
+
+/** Hashes the data if it continues on from what's been hashed already. */
+
+static void hash_bytes(zdecoder *zd, const unsigned char *buf, int cnt)
+{
+	zd->crc = crc_update(zd, zd->crc, buf, cnt);
+
+	if(zd->synced) {
+		sha256_update(&zd->pending, buf, cnt);
+		zd->hend += cnt;
+	}
+}
+
+
+static void data_bytes(zdecoder *zd, const unsigned char *buf, int cnt)
+{
+	if(zd->frame == ZDATA) {
+		if(zd->info->hashed_proc) {
+			hash_bytes(zd, buf, cnt);
+		}
+		zd->pos += cnt;
+		zd->info->offset += cnt;
+	} else if(zd->frame == ZFILE) {
+		if(cnt > ZDEC_SUBPACKET - zd->sublen) {
+			cnt = ZDEC_SUBPACKET - zd->sublen;
+		}
+		memcpy(zd->sub + zd->sublen, buf, cnt);
+		zd->sublen += cnt;
+	}
+}
+
+
+/** Reads a subpacket.  Nearly all the bytes in a transfer go through
+ *  here so it handles the run up to the next ZDLE in one go.  (sz
+ *  escapes XON and XOFF so there shouldn't be any raw ones to skip.)
+ */
+
+static const unsigned char* data_run(zdecoder *zd, const unsigned char *cp, const unsigned char *ce)
+{
+	const unsigned char *p;
+	unsigned char b;
+	int c;
+
+	if(!zd->esc) {
+		p = memchr(cp, ZDLE, ce - cp);
+		if(p == NULL) {
+			p = ce;
+		}
+		data_bytes(zd, cp, p - cp);
+		if(p == ce) {
+			return ce;
+		}
+		cp = p;
+	}
+
+	c = unescape(zd, *cp++);
+	if(c == NOTHING) {
+		return cp;
+	}
+	if(c == GARBAGE) {
+		zd->state = ST_IDLE;
+	} else if(c & FRAMEEND) {
+		end_subpacket(zd, c & 0377);
+	} else {
+		b = c;
+		data_bytes(zd, &b, 1);
+	}
+
+	return cp;
+}
+
+
+/** Feeds the bytes that just went by to the decoder. */
+
+void zdec_feed(zdecoder *zd, const char *buf, int size)
+{
+	const unsigned char *cp = (const unsigned char*)buf;
+	const unsigned char *ce = cp + size;
+	int c;
+
+	while(cp < ce) {
+		switch(zd->state) {
+			case ST_IDLE:
+				cp = memchr(cp, ZPAD, ce - cp);
+				if(cp == NULL) {
+					return;
+				}
+				cp += 1;
+				zd->state = ST_PAD;
+				break;
+
+			case ST_PAD:
+				c = *cp++;
+				if(c == ZDLE) {
+					zd->state = ST_PADZDLE;
+				} else if(c != ZPAD) {
+					zd->state = ST_IDLE;
+				}
+				break;
+
+			case ST_PADZDLE:
+				start_header(zd, *cp++);
+				break;
+
+			case ST_HEX:
+				hex_byte(zd, *cp++);
+				break;
+
+			case ST_BIN:
+			case ST_CRC:
+				bin_byte(zd, *cp++);
+				break;
+
+			case ST_DATA:
+				cp = data_run(zd, cp, ce);
+				break;
+		}
+	}
+}
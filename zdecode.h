@@ -0,0 +1,65 @@
+/* zdecode.h
+ * Scott Bronson
+ *
+ * Watches a zmodem stream go by and keeps track of the file being sent.
+ * Include sha256.h first.
+ */
+
+
+/** What the decoders have learned about the transfer.  Both directions
+ *  feed the same zinfo: the sender says which file and where its data
+ *  starts, the receiver says where it wants the sender to resume.
+ */
+
+typedef struct zinfo {
+	char filename[256];		///< the current file's name (unprintable chars are shown as '?')
+	char rawname[256];		///< the name exactly as the sender sent it, or "" if it was too long
+	int64_t size;			///< the current file's length, or -1 if the sender didn't say
+	uint64_t offset;		///< how far into the current file the transfer has gotten (for display; a ZRPOS moves it)
+	int file_num;			///< bumped each time a new file starts (0 until the first)
+
+	/** If set, the file's data is hashed as it goes by and this is
+	 *  called with the digest when the sender says it's done (ZEOF).
+	 *  It's not called if any of the file was missed.
+	 */
+	void (*hashed_proc)(struct zinfo *info, const unsigned char digest[32]);
+	void *refcon;
+	sha256_ctx sha;			///< the hash of the file's first `hashed` bytes
+	uint64_t hashed;		///< only data in subpackets that passed their CRC is counted
+	int hash_done;			///< hashed_proc has been called for this file
+} zinfo;
+
+
+#define ZDEC_SUBPACKET 1024	// we only keep the ZFILE subpacket, which is never longer
+
+
+/** The decoder's state.  It remembers where it was in a frame so a
+ *  frame may be split across any number of calls to zdec_feed.
+ */
+
+typedef struct {
+	zinfo *info;
+	int state;
+	int after;			///< the state to go to once the CRC has been skipped
+	int esc;			///< the last byte was a ZDLE
+	int crc32;			///< the frame uses 32-bit CRCs
+	int frame;			///< the header type whose data we're reading
+	int hexhi;			///< the first digit of a hex pair or -1
+	int need;			///< bytes left to collect for the header or CRC
+	int hlen;
+	unsigned char hdr[9];
+	int sublen;
+	char sub[ZDEC_SUBPACKET+1];
+
+	// for hashing (see zinfo::hashed_proc).  The subpacket is hashed
+	// into pending, which only replaces zinfo::sha if the CRC is good.
+	uint32_t crc;			///< the CRC of the subpacket so far
+	sha256_ctx pending;
+	uint64_t hend;			///< the file offset that pending has hashed up to
+	uint64_t pos;			///< where this stream's data is in the file (only its own ZDATA sets it)
+	int synced;				///< the data picks up exactly where zinfo::hashed left off
+} zdecoder;
+
+
+void zdec_init(zdecoder *zd, zinfo *info);
+void zdec_feed(zdecoder *zd, const char *buf, int size);
@@ -35,7 +35,7 @@
  *          Then, when the pipes are restored, the data is written back into the pipe
  * 		So the master actually cycles through 3 procs while scanning:
  * 			zfin_scan -> zfin_nooo -> zfin_save
- * 		Then, in the destructor, we copy the saved data back into the output pipe.
+ * 		Then, in the destructor, we write the saved data back into the output pipe.
  */
 
 
@@ -43,7 +43,11 @@
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
+#include "pool.h"
 #include "task.h"
+#include "zmark.h"
+#include "sha256.h"
+#include "zdecode.h"
 #include "zfin.h"
 #include "util.h"
 
@@ -52,6 +56,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+
+static __thread struct pool zfin_pool = POOL_INIT("zfinscanstate", zfinscanstate);
+static __thread struct pool zfin_seg_pool = POOL_INIT("zfin_seg", struct zfin_seg);
 
 
 zfinscanstate* zfin_create(master_pipe *mp,
@@ -59,15 +68,16 @@ zfinscanstate* zfin_create(master_pipe *mp,
 {
     zfinscanstate *state;
 
-    state = malloc(sizeof(zfinscanstate));
+    state = pool_alloc(&zfin_pool);
     if(state == NULL) {
         perror("allocating zfinscanstate");
         bail(56);
     }
-	memset(state, 0, sizeof(zfinscanstate));
 
 	state->master = mp;
 	state->found = proc;
+	state->decoder = NULL;
+	zmark_init(&state->scan);
 
     return state;
 
@@ -76,10 +86,34 @@ zfinscanstate* zfin_create(master_pipe *mp,
 
 void zfin_destroy(zfinscanstate *state)
 {
-	if(state->savebuf) {
-		free(state->savebuf);
+	struct zfin_seg *seg, *next;
+
+	for(seg = state->save_head; seg; seg = next) {
+		next = seg->next;
+		pool_free(&zfin_seg_pool, seg);
+	}
+	pool_free(&zfin_pool, state);
+}
+
+
+/** Writes the data saved by zfin_save into the pipe.  The segments are
+ *  handed to the pipe as-is so they're not copied again.
+ */
+
+void zfin_restore(zfinscanstate *state, struct pipe *pipe)
+{
+	struct iovec iov[16];
+	struct zfin_seg *seg = state->save_head;
+	int n;
+
+	while(seg) {
+		for(n=0; seg && n < sizeof(iov)/sizeof(iov[0]); n++) {
+			iov[n].iov_base = seg->data;
+			iov[n].iov_len = seg->len;
+			seg = seg->next;
+		}
+		pipe_writev(pipe, iov, n);
 	}
-	free(state);
 }
 
 
@@ -89,14 +123,14 @@ void zfin_destroy(zfinscanstate *state)
 void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 {
 	log_warn("enter: size=%d refcon=%08lX", size, (long)f->refcon);
-	int ofe = f->end;
+	uint64_t ofe = f->end;
 	orig_zfin_scan(f, buf, size, fd);
-	int nfe = f->end;
+	uint64_t nfe = f->end;
 
-	if(nfe >= ofe) {
+	if(fifo_pos(f, ofe) + size <= f->size) {
 		if(nfe - ofe != size) {
 			log_warn("sizes differ!");
-		} else if(memcmp(f->buf+ofe, buf, size) != 0) {
+		} else if(memcmp(f->buf+fifo_pos(f, ofe), buf, size) != 0) {
 			log_warn("contents differ!");
 		}
 	} else {
@@ -110,77 +144,48 @@ void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 #else
 
 
+/** Passes everything through until the end of the session (a ZFIN)
+ *  or a cancel, then hands the rest to the found proc.  The marker may
+ *  be split across any number of packets.
+ */
+
 void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 {
-	// technically this string should begin with "**".  however there's
-	// a boyer-mooreesque start problem: if the previous packet ends with
-	// "*", and the next packet is a ZFIN, this match algorightm won't
-	// find it.  It finds "**" (one star from prevous packet, one star
-	// from the next packet), fails to match \030 against the second star
-	// in the second packet, and starts over.  But now we only have one
-	// star!  The proper way is to implement a complex restart procedure.
-	// Much easier, though, to just search for the single star.  Since it's
-	// impossible for this sequence to be anywhere in a zmodem transfer
-	// OTHER than a ZFIN packet, it's an adequate workaround.
-
-	static const char zfin[] = "*\030B0800000000022d\015\212";
-
 	zfinscanstate *state = (zfinscanstate*)f->refcon;
-	const char *ref = state->ref;
-	const char *cp, *ce;
+	const char *cp = buf;
+	int marker;
 
 	if(size <= 0) {
 		return;
 	}
-	
-	for(;;) {
-		if(ref) {
-			cp = buf;
-//			log_dbg("zfin %d resuming string match at %d", fd, ref-zfin);
-		} else {
-//			log_dbg("zfin on %d: searching for '*' in %d bytes", fd, size);
-			cp = memchr(buf, '*', size);
-			if(!cp) {
-//				log_dbg("zfin on %d: '*' not found, returning entire buffer", fd);
-				// couldn't find the start char in the entire buffer.
-				fifo_unsafe_append(f, buf, size);
-				return;
-			}
 
-			// found the start char.  flush all the data up to the start char.
-			fifo_unsafe_append(f, buf, cp-buf);
-			size -= cp-buf;
-			buf = cp;
-			// and set up the state var
-			ref = zfin;
-		}
-		ce = buf + size;
+	do {
+		cp = zmark_run(&state->scan, cp, buf + size, &marker);
+	} while(marker == ZMARK_ZRQINIT);
 
-		while(cp < ce && *cp == *ref && ref < zfin+sizeof(zfin)-1) {
-			cp += 1;
-			ref += 1;
+	if(marker == ZMARK_NONE) {
+		if(state->decoder) {
+			zdec_feed(state->decoder, buf, size);
 		}
+		fifo_unsafe_append(f, buf, size);
+		return;
+	}
 
-		// append the data to the fifo no matter what.
-		fifo_unsafe_append(f, buf, cp-buf);
-		size -= cp-buf;
-		buf = cp;
+	// what follows the marker isn't part of the session
+	if(state->decoder) {
+		zdec_feed(state->decoder, buf, cp - buf);
+	}
 
-		if(*ref == 0) {
-			f->proc = state->found;
-			(*f->proc)(f, buf, size, fd);
-			return;
-		} else if(cp >= ce) {
-			// out of data, so we'll return and get called with more
-			state->ref = ref;
-			return;
-		} else if(*cp != *ref) {
-			// couldn't match.  append what we have so far.
-			ref = NULL;
-		} else {
-			assert(!"This should be unpossible!");
-		}
+	if(marker == ZMARK_ZCAN) {
+		// nobody says "OO" after a cancel.
+		log_info("zfin on %d: transfer was cancelled", fd);
+		state->oocount = 2;
 	}
+
+	// the marker goes through, what follows goes to the found proc.
+	fifo_unsafe_append(f, buf, cp - buf);
+	f->proc = state->found;
+	(*f->proc)(f, cp, size - (cp - buf), fd);
 }
 
 #endif
@@ -210,7 +215,7 @@ void zfin_nooo(struct fifo *f, const char *buf, int size, int fd)
 }
 
 
-/** Saves all text in a dynamic buffer.  When the destructor is
+/** Saves all text in a list of segments.  When the destructor is
  *  called, the saved text will be inserted into the pipe (now
  *  reconnected to the terminal instead of to the receive process).
  */
@@ -223,19 +228,34 @@ void zfin_save(struct fifo *f, const char *buf, int size, int fd)
 		return;
 	}
 
-	if(size + state->savecnt > state->savemax) {
-		state->savemax += size + 512;
-		log_info("Reallocing save buffer to %d bytes.", (int)state->savemax);
-		state->savebuf = realloc(state->savebuf, state->savemax);
-		if(state->savebuf == NULL) {
-			perror("reallocing savebuf");
-			bail(57);
-		}
-	}
-
 	log_info("SAVING %d bytes from %d: %s", size, fd, sanitize(buf, size));
-	memcpy(state->savebuf + state->savecnt, buf, size);
 	state->savecnt += size;
+
+	while(size > 0) {
+		struct zfin_seg *seg = state->save_tail;
+		int cnt;
+
+		if(seg == NULL || seg->len >= ZFIN_SEG_SIZE) {
+			seg = pool_alloc(&zfin_seg_pool);
+			if(seg == NULL) {
+				perror("allocating save segment");
+				bail(57);
+			}
+			if(state->save_tail) {
+				state->save_tail->next = seg;
+			} else {
+				state->save_head = seg;
+			}
+			state->save_tail = seg;
+		}
+
+		cnt = ZFIN_SEG_SIZE - seg->len;
+		if(cnt > size) cnt = size;
+		memcpy(seg->data + seg->len, buf, cnt);
+		seg->len += cnt;
+		buf += cnt;
+		size -= cnt;
+	}
 }
 
 
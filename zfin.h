@@ -4,15 +4,28 @@
  */
 
 
+/** zfin_save stores data in a list of these. */
+
+#define ZFIN_SEG_SIZE 2048
+
+struct zfin_seg {
+	struct zfin_seg *next;
+	int len;
+	char data[ZFIN_SEG_SIZE];
+};
+
+
 typedef struct {
 	void (*found)(struct fifo *f, const char *buf, int size, int fd);
-	const char *ref;	// remembers where in the zfin string we're scanning.
+	zmark scan;			// remembers how much of a marker we've seen
 	int oocount;		// remembers how many Os we've seen
 
-	char *savebuf;	// saves all data after the ZFIN+OO.
-	int savemax;
+	struct zfin_seg *save_head;	// saves all data after the ZFIN+OO.
+	struct zfin_seg *save_tail;
 	int savecnt;
 
+	zdecoder *decoder;	// if set, everything that goes by is fed to it too
+
 	master_pipe *master;
 } zfinscanstate;
 
@@ -20,6 +33,7 @@ typedef struct {
 zfinscanstate* zfin_create(master_pipe *mp,
 		void (*proc)(struct fifo *f, const char *buf, int size, int fd));
 void zfin_destroy(zfinscanstate *state);
+void zfin_restore(zfinscanstate *state, struct pipe *pipe);
 void zfin_scan(struct fifo *f, const char *buf, int size, int fd);
 void zfin_nooo(struct fifo *f, const char *buf, int size, int fd);
 void zfin_save(struct fifo *f, const char *buf, int size, int fd);
@@ -0,0 +1,203 @@
+/* zmark.c
+ * Scott Bronson
+ *
+ * Finds zmodem markers (ZRQINIT, ZFIN, and cancels) in a stream using
+ * the DFA that zmarkgen.c generates at build time.  Each byte costs
+ * one table lookup, whatever it is, and a marker can be split across
+ * any number of packets.
+ *
+ * Nearly every byte that passes through here is ordinary shell output
+ * or file data, so while nothing is partially matched the scanner
+ * hunts for the next byte that could start a marker.  On x86 that
+ * hunt compares 16 (SSE2) or 32 (AVX2) bytes at a time.  The kernel
+ * is picked the first time it's needed, based on what the CPU supports.
+ */
+
+
+#include "log.h"
+#include "zmark.h"
+#include "zmark_tab.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ZMARK_HAVE_SIMD
+#endif
+
+
+int zmark_simd = 1;	// 0 to always use the scalar skip loop
+
+
+/** Returns the first byte in [cp,ce) that could start a marker, or ce. */
+
+static const char* skip_scalar(const char *cp, const char *ce)
+{
+	int i;
+
+	for(; cp < ce; cp++) {
+		for(i=0; i<ZMARK_NFIRST; i++) {
+			if(*cp == zmark_first[i]) {
+				return cp;
+			}
+		}
+	}
+
+	return cp;
+}
+
+
+#ifdef ZMARK_HAVE_SIMD
+
+__attribute__((target("sse2")))
+static const char* skip_sse2(const char *cp, const char *ce)
+{
+	__m128i first[ZMARK_NFIRST];
+	__m128i v, hit;
+	int i, mask;
+
+	for(i=0; i<ZMARK_NFIRST; i++) {
+		first[i] = _mm_set1_epi8(zmark_first[i]);
+	}
+
+	while(ce - cp >= 16) {
+		v = _mm_loadu_si128((const __m128i*)cp);
+		hit = _mm_cmpeq_epi8(v, first[0]);
+		for(i=1; i<ZMARK_NFIRST; i++) {
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, first[i]));
+		}
+		mask = _mm_movemask_epi8(hit);
+		if(mask) {
+			return cp + __builtin_ctz(mask);
+		}
+		cp += 16;
+	}
+
+	return skip_scalar(cp, ce);
+}
+
+
+__attribute__((target("avx2")))
+static const char* skip_avx2(const char *cp, const char *ce)
+{
+	__m256i first[ZMARK_NFIRST];
+	__m256i v, hit;
+	unsigned int mask;
+	int i;
+
+	for(i=0; i<ZMARK_NFIRST; i++) {
+		first[i] = _mm256_set1_epi8(zmark_first[i]);
+	}
+
+	while(ce - cp >= 32) {
+		v = _mm256_loadu_si256((const __m256i*)cp);
+		hit = _mm256_cmpeq_epi8(v, first[0]);
+		for(i=1; i<ZMARK_NFIRST; i++) {
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, first[i]));
+		}
+		mask = (unsigned int)_mm256_movemask_epi8(hit);
+		if(mask) {
+			return cp + __builtin_ctz(mask);
+		}
+		cp += 32;
+	}
+
+	// fewer than 32 bytes left
+	return skip_sse2(cp, ce);
+}
+
+#endif
+
+
+static const char* skip_pick(const char *cp, const char *ce);
+
+// the skip kernel.  Starts out pointing at skip_pick, which replaces it.
+// Each thread picks its own so none of them sees another's half-done pick.
+static __thread const char* (*skip)(const char *cp, const char *ce) = skip_pick;
+
+
+static const char* skip_pick(const char *cp, const char *ce)
+{
+	const char *name = "scalar";
+
+	skip = skip_scalar;
+
+#ifdef ZMARK_HAVE_SIMD
+	if(zmark_simd) {
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) {
+			skip = skip_avx2;
+			name = "avx2";
+		} else if(__builtin_cpu_supports("sse2")) {
+			skip = skip_sse2;
+			name = "sse2";
+		}
+	}
+#endif
+
+	log_info("zmark: using the %s skip kernel", name);
+	return (*skip)(cp, ce);
+}
+
+
+/** Feeds the bytes from cp to ce through the scanner.
+ *
+ *  @returns a pointer just past the first marker found and sets *marker
+ *  to say which it was, or returns ce and sets *marker to ZMARK_NONE.
+ *  zmark_depth then gives the marker's length.  Call again with the
+ *  returned pointer to keep going.
+ */
+
+const char* zmark_run(zmark *zm, const char *cp, const char *ce, int *marker)
+{
+	int st = zm->state;
+
+	while(cp < ce) {
+		if(st == 0) {
+			cp = (*skip)(cp, ce);
+			if(cp >= ce) {
+				break;
+			}
+		}
+
+		st = zmark_next[st][(unsigned char)*cp++];
+		if(zmark_found[st]) {
+			zm->state = st;
+			*marker = zmark_found[st];
+			return cp;
+		}
+	}
+
+	zm->state = st;
+	*marker = ZMARK_NONE;
+	return ce;
+}
+
+
+/** Returns how many of the bytes most recently scanned might be the
+ *  start of a marker.
+ */
+
+int zmark_depth(zmark *zm)
+{
+	return zmark_depths[zm->state];
+}
+
+
+/** Returns the bytes counted by zmark_depth.  They're always the
+ *  start of some marker so the scanner can hand them back without
+ *  having to remember them.
+ */
+
+const char* zmark_text(zmark *zm)
+{
+	return zmark_texts[zm->state];
+}
+
+
+/** Says whether it's OK to hold on to a partial match until more
+ *  data arrives (see holdable() in zmarkgen.c).
+ */
+
+int zmark_holdable(zmark *zm)
+{
+	return zmark_hold[zm->state];
+}
@@ -0,0 +1,34 @@
+/* zmark.h
+ * Scott Bronson
+ *
+ * Finds the zmodem markers that rzh cares about in a stream.
+ */
+
+
+/** What zmark_run found.  The patterns behind each one are in zmarkgen.c. */
+
+enum zmark_marker {
+	ZMARK_NONE = 0,
+	ZMARK_ZRQINIT,		///< A sender wants to start a transfer (with its optional "rz\r").
+	ZMARK_ZFIN,			///< The end of a session.
+	ZMARK_ZCAN,			///< The transfer was cancelled.
+};
+
+
+/** The scanner's state.  It's just a position in the DFA, so a marker
+ *  may be split across any number of calls to zmark_run.
+ */
+
+typedef struct {
+	int state;
+} zmark;
+
+#define zmark_init(zm) ((zm)->state = 0)
+
+
+extern int zmark_simd;
+
+const char* zmark_run(zmark *zm, const char *cp, const char *ce, int *marker);
+int zmark_depth(zmark *zm);
+const char* zmark_text(zmark *zm);
+int zmark_holdable(zmark *zm);
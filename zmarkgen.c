@@ -0,0 +1,233 @@
+/* zmarkgen.c
+ * Scott Bronson
+ *
+ * Builds the DFA that zmark.c uses to find zmodem markers.  This is
+ * run at build time: "zmarkgen > zmark_tab.h".
+ *
+ * The patterns are compiled into an Aho-Corasick automaton and then
+ * every failure link is followed ahead of time, so the scanner makes
+ * exactly one table lookup per byte and never backs up.  Each state
+ * is the longest tail of the input that could still grow into a
+ * marker, so its depth is how many bytes are partially matched and
+ * its text is what those bytes were.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zmark.h"
+
+
+static const struct pattern {
+	const char *text;
+	int marker;
+} patterns[] = {
+	// ZRQINIT is a hex header: "**", ZDLE, 'B', then type 00.  sz
+	// sends "rz\r" first to start the receiver; that gets eaten too.
+	// One star is enough in case the first was flushed on its own.
+	{ "*\030B00", ZMARK_ZRQINIT },
+	{ "**\030B00", ZMARK_ZRQINIT },
+	{ "rz\r*\030B00", ZMARK_ZRQINIT },
+	{ "rz\r**\030B00", ZMARK_ZRQINIT },
+	{ "rz\n*\030B00", ZMARK_ZRQINIT },
+	{ "rz\n**\030B00", ZMARK_ZRQINIT },
+	{ "rz\r\n*\030B00", ZMARK_ZRQINIT },
+	{ "rz\r\n**\030B00", ZMARK_ZRQINIT },
+
+	// the whole ZFIN header: type 08, no flags, its CRC, then CR
+	// and LF with the high bit set.
+	{ "**\030B0800000000022d\r\212", ZMARK_ZFIN },
+
+	// Five CANs can't appear anywhere in a zmodem stream (a CAN in
+	// the data is escaped) except when one side gives up.
+	{ "\030\030\030\030\030", ZMARK_ZCAN },
+};
+
+#define NPATTERNS ((int)(sizeof(patterns)/sizeof(patterns[0])))
+#define MAX_STATES 256		// zmark_next is unsigned char
+#define MAX_TEXT 32
+
+
+static int num_states = 1;	// state 0 is the root
+static int next[MAX_STATES][256];
+static int fail[MAX_STATES];
+static int depth[MAX_STATES];
+static int found[MAX_STATES];
+static char text[MAX_STATES][MAX_TEXT];
+
+
+static void add_pattern(const struct pattern *p)
+{
+	int len = strlen(p->text);
+	int st = 0;
+	int i, c;
+
+	if(len >= MAX_TEXT) {
+		fprintf(stderr, "zmarkgen: pattern is too long\n");
+		exit(1);
+	}
+
+	for(i=0; i<len; i++) {
+		c = (unsigned char)p->text[i];
+		if(next[st][c] < 0) {
+			if(num_states >= MAX_STATES) {
+				fprintf(stderr, "zmarkgen: too many states\n");
+				exit(1);
+			}
+			next[st][c] = num_states;
+			depth[num_states] = i + 1;
+			memcpy(text[num_states], p->text, i + 1);
+			num_states += 1;
+		}
+		st = next[st][c];
+	}
+
+	found[st] = p->marker;
+}
+
+
+/** Turns the trie into a DFA.  The states are numbered in the order
+ *  they were created, which isn't breadth-first, so this walks
+ *  them by depth.  A state's failure link always points shallower.
+ */
+
+static void build_dfa()
+{
+	int d, st, c, t, maxdepth = 0;
+
+	for(st=0; st<num_states; st++) {
+		if(depth[st] > maxdepth) maxdepth = depth[st];
+	}
+
+	for(c=0; c<256; c++) {
+		if(next[0][c] < 0) {
+			next[0][c] = 0;
+		} else {
+			fail[next[0][c]] = 0;
+		}
+	}
+
+	for(d=1; d<=maxdepth; d++) {
+		for(st=0; st<num_states; st++) {
+			if(depth[st] != d) {
+				continue;
+			}
+
+			if(found[st] == ZMARK_NONE && found[fail[st]] != ZMARK_NONE) {
+				// zmark_depth is taken to be the marker's length.
+				fprintf(stderr, "zmarkgen: \"%s\" contains another marker\n",
+						text[st]);
+				exit(1);
+			}
+
+			for(c=0; c<256; c++) {
+				t = next[st][c];
+				if(t < 0) {
+					next[st][c] = next[fail[st]][c];
+				} else {
+					fail[t] = next[fail[st]][c];
+				}
+			}
+		}
+	}
+}
+
+
+/** Says whether zrq may hold a partial match across a packet boundary
+ *  (otherwise the bytes are shown immediately and matching restarts).
+ *  An 'r' or '*' might be something the user just typed and is waiting
+ *  to see echoed, but a whole "rz\r" or a star followed by ZDLE isn't.
+ */
+
+static int holdable(const char *s)
+{
+	return strstr(s, "*\030") != NULL || strcmp(s, "rz\r") == 0 ||
+		strcmp(s, "rz\n") == 0 || strcmp(s, "rz\r\n") == 0;
+}
+
+
+static void print_text(const char *s)
+{
+	putchar('"');
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+		} else if(*s >= ' ' && *s < 127) {
+			putchar(*s);
+		} else {
+			printf("\\%03o", (unsigned char)*s);
+		}
+	}
+	putchar('"');
+}
+
+
+int main()
+{
+	char first[256];
+	int nfirst = 0;
+	int st, c, i;
+
+	memset(next, -1, sizeof(next));
+	for(i=0; i<NPATTERNS; i++) {
+		add_pattern(&patterns[i]);
+	}
+
+	// the bytes that can start a marker, before the root fills in
+	for(c=0; c<256; c++) {
+		if(next[0][c] >= 0) {
+			first[nfirst++] = c;
+		}
+	}
+	first[nfirst] = '\0';
+
+	build_dfa();
+
+	printf("/* zmark_tab.h\n * Generated by zmarkgen.c.  Do not edit.\n */\n\n");
+	printf("#define ZMARK_STATES %d\n\n", num_states);
+
+	printf("static const unsigned char zmark_next[ZMARK_STATES][256] = {\n");
+	for(st=0; st<num_states; st++) {
+		printf("\t{");
+		for(c=0; c<256; c++) {
+			printf("%s%d,", c % 32 ? "" : "\n\t\t", next[st][c]);
+		}
+		printf("\n\t},\n");
+	}
+	printf("};\n\n");
+
+	printf("static const unsigned char zmark_found[ZMARK_STATES] = {");
+	for(st=0; st<num_states; st++) {
+		printf("%s%d,", st % 32 ? "" : "\n\t", found[st]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const unsigned char zmark_depths[ZMARK_STATES] = {");
+	for(st=0; st<num_states; st++) {
+		printf("%s%d,", st % 32 ? "" : "\n\t", depth[st]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const unsigned char zmark_hold[ZMARK_STATES] = {");
+	for(st=0; st<num_states; st++) {
+		printf("%s%d,", st % 32 ? "" : "\n\t", holdable(text[st]));
+	}
+	printf("\n};\n\n");
+
+	printf("static const char *const zmark_texts[ZMARK_STATES] = {\n");
+	for(st=0; st<num_states; st++) {
+		printf("\t");
+		print_text(text[st]);
+		printf(",\n");
+	}
+	printf("};\n\n");
+
+	printf("#define ZMARK_NFIRST %d\n", nfirst);
+	printf("static const char zmark_first[] = ");
+	print_text(first);
+	printf(";\n");
+
+	return 0;
+}
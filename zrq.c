@@ -2,13 +2,15 @@
  * Scott Bronson
  * 13 June 2005
  *
- * Uses a pseudo coroutine to scan a buffer for the ZRQINIT
- * zmodem start sequence.
+ * Scans a buffer for the ZRQINIT zmodem start sequence (see zmark.c)
+ * and starts the receive task when it turns up.
  */
 
 
 #include "fifo.h"
 #include "log.h"
+#include "pool.h"
+#include "zmark.h"
 #include "zrq.h"
 #include "util.h"
 
@@ -16,28 +18,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 
-static void zscanstate_init(zscanstate *conn)
-{
-	conn->parse_state = 0;
-	conn->gotrz = RZNONE;
-	conn->starcnt = 0;
-}
+static __thread struct pool zscan_pool = POOL_INIT("zscanstate", zscanstate);
 
 
 zscanstate* zrq_create(zstart_proc proc, void *refcon)
 {
     zscanstate *zscan;
 
-    zscan = malloc(sizeof(zscanstate));
+    zscan = pool_alloc(&zscan_pool);
     if(zscan == NULL) {
         perror("allocating zscanstate");
         bail(55);
     }
 
-    zscanstate_init(zscan);
+    zmark_init(&zscan->scan);
     zscan->start_proc = proc;
     zscan->start_refcon = refcon;
 
@@ -47,274 +43,134 @@ zscanstate* zrq_create(zstart_proc proc, void *refcon)
 
 void zrq_destroy(zscanstate *state)
 {
-	free(state);
+	pool_free(&zscan_pool, state);
 }
 
 
-static void fifo_append_rz(struct fifo *f, int gotrz)
-{
-	switch(gotrz) {
-		case RZNL:
-			fifo_unsafe_append(f, "rz\n", 3);
-			break;
-		case RZCR:
-			fifo_unsafe_append(f, "rz\r", 3);
-			break;
-		case RZCRNL:
-			fifo_unsafe_append(f, "rz\r\n", 4);
-			break;
-		default:
-			; // do nothing
-	}
-}
+/** Passes data to whatever proc is on the fifo now.  */
 
-
-static void fifo_append_stars(struct fifo *f, int starcnt)
+static void zscan_feed(struct fifo *f, const char *buf, int cnt, int fd)
 {
-	int i;
+	if(cnt <= 0) {
+		return;
+	}
 
-	for(i=0; i<starcnt; i++) {
-		fifo_unsafe_addchar(f, '*');
+	if(f->proc) {
+		(*f->proc)(f, buf, cnt, fd);
+	} else {
+		fifo_unsafe_append(f, buf, cnt);
 	}
 }
 
 
-/** we can't switch over until the fifo is empty
- * (else the data would go to the wrong place)
- *
- * We'll try to write for 10 seconds, then assume that we've deadlocked
- * and terminate the program.  In practice, the fifo is almost always
- * empty and this loop is never entered anyway.
- * 
- * TODO
- *
- * Frankly, this routine sucks ass.  There's a vanishingly small but
- * nonzero chance of deadlock
- * since we're not handling any other I/O while this is happening.
+/** Called once everything in front of the ZRQINIT has been written
+ *  (see fifo_mark).  What's left in the fifo arrived after it so it
+ *  belongs to the new task.  It's taken out and handed to the new
+ *  task's proc as if it had just been read.
  *
- * Instead of doing this, we should mark the fifo with the new task_spec at
- * the start of the rz data.  Then, when it has drained to that point normally,
- * the task_spec would be installed automatically.  Scanning would then be
- * just marking, not copying (except that it must be able to remove the
- * rz\r somehow).
+ *  That's done a piece at a time through a buffer on the stack.  The
+ *  pieces come off the front of the fifo and whatever the proc keeps
+ *  goes on the end, so it all stays in order.
  */
 
-static void fifo_drain_completely(struct fifo *f, int fd)
+static void zscan_handoff(struct fifo *f, void *refcon)
 {
-	int i = 0;
-
-	// Try to write.  We sleep to try to give the system enough
-	// time to free up whatever it's doing in the foreground.
-	while(fifo_count(f) > 0) {
-		fifo_write(f, fd);
-		sleep(1);
-		i += 1;
-		if(i >= 5) {
-			fprintf(stderr, "Could not empty zscan fifo in 5 seconds (had %d bytes at end).  Bailing!\n", fifo_count(f));
-			bail(33);
-		}
-	}
-}
+	zscanstate *conn = refcon;
+	char buf[BUFSIZ];
+	int cnt = fifo_count(f);
+	int n;
 
-static void fifo_drain_avail(struct fifo *f, int fd, int min_needed)
-{
-	int i = 0;
-
-	// Try to write.  We sleep to try to give the system enough
-	// time to free up whatever it's doing in the foreground.
-	while(fifo_avail(f) < min_needed) {
-		fifo_write(f, fd);
-		sleep(1);
-		i += 1;
-		if(i >= 5) {
-			fprintf(stderr, "Could not free up %d bytes in zscan fifo in 5 seconds (had %d bytes at end).  Bailing!\n",
-					min_needed, fifo_avail(f));
-			bail(33);
-		}
+	log_info("Drained to the zrq mark, starting with %d bytes waiting.", cnt);
+
+	(*conn->start_proc)(conn->start_refcon);
+
+	while(cnt > 0) {
+		n = cnt < (int)sizeof(buf) ? cnt : (int)sizeof(buf);
+		fifo_unsafe_unpend(f, buf, n);
+		zscan_feed(f, buf, n, conn->fd);
+		cnt -= n;
 	}
 }
 
 
-/** This routine is SUCH AN AWFUL HACK!!!  It doesn't update
- *  pipe->bytes_written, it does i/o without ever crossing the main
- *  event loop, bleah!!  OTOH, it works now and it would take a lot
- *  of time to fix properly.  I can live with it for now.
+/** Starts the receive task.  We can't switch over until the data in
+ *  front of the ZRQINIT has gone out (else it would go to the wrong
+ *  place).  Usually that's nothing, so the switch happens right now.
+ *  Otherwise the fifo is marked and the switch happens when the pipe
+ *  drains to the mark through the event loop like any other write.
+ *  Until then, anything that arrives is stored after the mark without
+ *  being scanned.
  */
 
 static void zscan_start(zscanstate *conn, struct fifo *f, const char *cp, const char *ce, int fd)
 {
-	int remaining = ce - cp;
-
-	log_info("Draining %d bytes to %d before starting.", fifo_count(f), fd);
-	fifo_drain_completely(f, fd);
-	fifo_unsafe_append_str(f, "**\030B00");
-
-	// start the subtask
-	(*conn->start_proc)(conn->start_refcon);
-
-	// There is probably a different filter proc on the fifo now.
-	// We'll call it with the remaining data.
-	if(remaining > 0) {
-		// Because we just appended the start string, there might
-		// not be enough room to store the remaining fifo data.
-		// (maybe pipe is drastically write-bound and the few extra
-		// bytes of the start string overflowed it)
-
-		if(remaining > fifo_avail(f)) {
-			fifo_drain_avail(f, fd, remaining);
-		}
-		if(f->proc) {
-			(*f->proc)(f, cp, remaining, fd);
-		} else {
-			// no proc, just append the rest
-			fifo_unsafe_append(f, cp, remaining);
-		}
+	// The header goes to rz without the "rz\r".  It gets both stars
+	// even if the first was shown already, but only if there's room
+	// for the byte we didn't eat.
+	const char *hdr = strchr(zmark_text(&conn->scan), '*');
+	char buf[8];
+	int n = 0;
+
+	if(hdr[1] != '*' && fifo_avail(f) > (int)strlen(hdr) + (ce - cp)) {
+		buf[n++] = '*';
 	}
-
-	// Now the next task can continue on its merry way.
-}
-
-
-#define crBegin()                           \
-	switch(conn->parse_state) {             \
-		case 0:
-
-#define crEnd()                             \
+	strcpy(buf + n, hdr);
+	zmark_init(&conn->scan);
+
+	if(fifo_empty(f)) {
+		(*conn->start_proc)(conn->start_refcon);
+		zscan_feed(f, buf, strlen(buf), fd);
+		zscan_feed(f, cp, ce - cp, fd);
+		return;
 	}
 
-#define crNext(st)							\
-	do {                    				\
-		conn->parse_state=st;				\
-		cp += 1;                            \
-		if(cp >= ce) return;          		\
-		case st:;							\
-	} while(0)
-
+	log_info("Draining %d bytes to %d before starting.", fifo_count(f), fd);
+	conn->fd = fd;
+	fifo_mark(f, zscan_handoff, conn);
+	f->proc = NULL;
+	fifo_unsafe_append_str(f, buf);
+	fifo_unsafe_append(f, cp, ce - cp);
+}
 
 
-/** Scan for the start of a ZRQINIT header.  zmodem transfers often
- * 	begin with a "rz\n" character sequence.  We try to suppress that.
- *
- * 	We need to be a bit tricky with two sequences.  "rz\n" must all
- * 	appear in a single packet.  Otherwise, the user may have typed it
- * 	and will be wondering why the "r" he just typed is being suppressed!
- * 	Same with the "**\030" sequence -- the user might be wondering where
- * 	the asterixes he typed went!  Other than those two sequences, the
- * 	packet boundaries may fall wherever.
+/** Scans for the start of a zmodem transfer: a ZRQINIT header,
+ *  maybe preceded by "rz\r".  Everything else goes into the fifo.
  *
- * 	This behavior may cause us to miss some start packets, but I think
- * 	that's unlikely.  Far better that than try to explain to the user
- * 	why "r"s and "*"s don't appear until you type more characters...
+ *  The bytes of a partial match are held back (see fifo::hold) so
+ *  they can be eaten if it completes.  But only if they look like
+ *  zmodem.  An "r" or "*" at the end of a packet is probably something
+ *  the user just typed and is wondering why it hasn't appeared.  Those
+ *  are let go and the match starts over with the next packet.
  */
 
 void zrq_scan(zscanstate *conn, const char *cp, const char *ce, struct fifo *f, int fd)
 {
-	const char *cb;
-
-	crBegin();
-
-	for(;;) {
-		if(cp >= ce) {
-			return;
-		}
-
-		// skip as much garbage as we can
-		cb = cp;
-		while(cp < ce && *cp != 'r' && *cp != '*') {
-			cp++;
-		}
-
-		if(cp > cb) {
-			fifo_unsafe_append(f, cb, cp-cb);
-			if(cp >= ce) {
-				return;
-			}
-			cb = cp;
-		}
-
-		if(cp[0] == 'r') {
-			if(ce - cp < 3) {
-				// We require the "rz\n" to appear entirely within a single
-				// packet.  This prevents eating r/z's that the user types.
-				fifo_unsafe_append(f, cp, ce-cp);
-				return;
-			}
-
-			if(cp[1] == 'z') {
-				if(cp[2] == '\r') {
-					if(ce - cp >= 4 && cp[3] == '\n') {
-						conn->gotrz = RZCRNL;
-						cp += 4;
-					} else {
-						conn->gotrz = RZCR;
-						cp += 3;
-					}
-				} else if(cp[2] == '\n') {
-					conn->gotrz = RZNL;
-					cp += 3;
-				} else {
-					fifo_unsafe_append_str(f, "rz");
-					cp += 2;
-					continue;
-				}
-			} else {
-				fifo_unsafe_addchar(f, 'r');
-				cp += 1;
-				continue;
-			}
-		}
-
-		conn->parse_state = -1;
-		if(cp >= ce) return;
-		case -1:;
-
-		if(cp[0] == '*') {
-
-			// there may be any number of stars
-			while(cp < ce && *cp == '*') {
-				conn->starcnt += 1;
-				cp++;
-			}
-
-			if(cp < ce) {
-				if(*cp == '\030') {
-					crNext(1);
-					if(*cp == 'B') {
-						crNext(2);
-						if(*cp == '0') {
-							crNext(3);
-							if(*cp == '0') {
-								cp += 1;	// don't use crNext because
-									// we don't care if we're out of data --
-									// the zmodem receive will start anyway.
-								log_info("zrq on %d found!", fd);
-								/*
-								extern void logio(char *gr1, char* gr2, int fd, const char *buf, int cnt, int act);
-								logio("There are", "remaining on", fd, cp, ce-cp, ce-cp);
-								*/
-								zscanstate_init(conn);
-								zscan_start(conn, f, cp, ce, fd);
-								return;
-							}
-						}
-					}
-				}
-			}
-
-			fifo_append_rz(f, conn->gotrz);
-			conn->gotrz = 0;
-			fifo_append_stars(f, conn->starcnt);
-			if(conn->parse_state >= 1) fifo_unsafe_addchar(f, '\030');
-			if(conn->parse_state >= 2) fifo_unsafe_addchar(f, 'B');
-			if(conn->parse_state >= 3) fifo_unsafe_addchar(f, '0');
-		}
-
-		if(conn->gotrz) {
-			fifo_append_rz(f, conn->gotrz);
-		}
-		zscanstate_init(conn);
+	const char *cb = cp;
+	const char *held = zmark_text(&conn->scan);	// held from earlier packets
+	int carry = zmark_depth(&conn->scan);
+	int marker, out;
+
+	do {
+		cp = zmark_run(&conn->scan, cp, ce, &marker);
+	} while(marker != ZMARK_NONE && marker != ZMARK_ZRQINIT);
+
+	if(marker == ZMARK_NONE && !zmark_holdable(&conn->scan)) {
+		zmark_init(&conn->scan);
 	}
 
-	crEnd();
-}
+	// Append everything in front of the bytes the scanner is still
+	// holding (or, if it found a ZRQINIT, in front of the match).
+	out = carry + (cp - cb) - zmark_depth(&conn->scan);
+	fifo_unsafe_append(f, held, out < carry ? out : carry);
+	if(out > carry) {
+		fifo_unsafe_append(f, cb, out - carry);
+	}
+
+	if(marker == ZMARK_ZRQINIT) {
+		log_info("zrq on %d found!", fd);
+		zscan_start(conn, f, cp, ce, fd);
+	}
 
+	// If we started a task, the scanner was reset so this clears the hold.
+	f->hold = zmark_depth(&conn->scan);
+}
@@ -8,12 +8,11 @@ typedef void (*zstart_proc)(void *refcon);
 
 
 typedef struct {
-	int parse_state;
-	enum { RZNONE, RZNL, RZCR, RZCRNL } gotrz;
-	int starcnt;
+	zmark scan;
 
 	zstart_proc start_proc;
 	void *start_refcon;
+	int fd;			///< the fd we were reading when the ZRQINIT turned up
 } zscanstate;
 
 